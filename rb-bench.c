@@ -0,0 +1,455 @@
+#include "rb.h"
+
+#include <assert.h>
+#include <inttypes.h>
+#include <math.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define MAX_KEY_WIDTH 64
+#define MAX_SAMPLES 1000000
+
+// ----------------------------------------------------------------------------
+// Helpers
+// ----------------------------------------------------------------------------
+
+enum workload {
+    SEQUENTIAL,
+    RANDOM,
+    ZIPFIAN,
+};
+
+static const char *workload_names[] = {"seq", "random", "zipf"};
+
+struct config {
+    enum workload workload;
+    size_t size;
+    size_t ops;
+    unsigned key_width;
+    unsigned mix[3]; // Percentages of insert, search, and remove operations.
+    unsigned long seed;
+    bool generated; // Use the functions generated by RB_GENERATE() instead of rb_*.
+    bool profile;   // Report the shape of the tree after the run.
+};
+
+/*
+ * Elements are allocated in a single pool with a stride of `elem_size` bytes.
+ * The key is stored big-endian in the first `key_width` bytes so that memcmp()
+ * orders keys numerically, whatever the width.
+ */
+struct elem {
+    struct rb_node rb_node;
+    unsigned char key[];
+};
+
+static unsigned key_width;
+static uint64_t comparisons;
+
+static inline int
+elem_cmp(struct elem *l, struct elem *r) {
+    comparisons += 1;
+    return memcmp(l->key, r->key, key_width);
+}
+
+RB_GENERATE(elem_tree, struct elem, rb_node, elem_cmp)
+
+static void
+set_key(struct elem *elem, uint64_t key) {
+    memset(elem->key, 0, key_width);
+    for (unsigned i = 0; i < key_width && i < sizeof(key); i += 1) {
+        elem->key[key_width - 1 - i] = (unsigned char) (key >> (8 * i));
+    }
+}
+
+/*
+ * xorshift64*, which is good enough for generating workloads and, unlike
+ * rand(), covers the full range of a 100M element key space.
+ */
+static uint64_t
+next_random(uint64_t *state) {
+    *state ^= *state >> 12;
+    *state ^= *state << 25;
+    *state ^= *state >> 27;
+    return *state * 0x2545f4914f6cdd1dULL;
+}
+
+/*
+ * Zipfian generator over [0, n) with skew theta, following Gray et al.,
+ * "Quickly Generating Billion-Record Synthetic Databases".
+ */
+struct zipf {
+    uint64_t n;
+    double theta;
+    double alpha;
+    double zeta_n;
+    double eta;
+};
+
+static struct zipf
+zipf_init(uint64_t n, double theta) {
+    struct zipf z;
+    z.n = n;
+    z.theta = theta;
+    z.alpha = 1.0 / (1.0 - theta);
+
+    double zeta_2 = 1.0 + pow(0.5, theta);
+    z.zeta_n = 0.0;
+    for (uint64_t i = 1; i <= n; i += 1) {
+        z.zeta_n += 1.0 / pow((double) i, theta);
+    }
+
+    z.eta = (1.0 - pow(2.0 / (double) n, 1.0 - theta)) / (1.0 - zeta_2 / z.zeta_n);
+    return z;
+}
+
+static uint64_t
+zipf_next(struct zipf *z, uint64_t *state) {
+    double u = (double) (next_random(state) >> 11) / (double) (1ULL << 53);
+    double uz = u * z->zeta_n;
+
+    if (uz < 1.0) {
+        return 0;
+    }
+
+    if (uz < 1.0 + pow(0.5, z->theta)) {
+        return 1;
+    }
+
+    uint64_t rank = (uint64_t) ((double) z->n * pow(z->eta * u - z->eta + 1.0, z->alpha));
+    return rank < z->n ? rank : z->n - 1;
+}
+
+static uint64_t
+now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + (uint64_t) ts.tv_nsec;
+}
+
+static int
+cmp_u32(const void *l, const void *r) {
+    uint32_t a = *(const uint32_t *) l;
+    uint32_t b = *(const uint32_t *) r;
+    return (a > b) - (a < b);
+}
+
+static uint32_t
+percentile(uint32_t *samples, size_t n, double p) {
+    if (n == 0) {
+        return 0;
+    }
+
+    size_t i = (size_t) (p * (double) (n - 1));
+    return samples[i];
+}
+
+// ----------------------------------------------------------------------------
+// Benchmark
+// ----------------------------------------------------------------------------
+
+/*
+ * Run a single operation of the given kind.
+ */
+static inline void
+run_op(struct config *config, struct rb_tree *tree, struct elem *elem, unsigned char kind) {
+    if (config->generated) {
+        switch (kind) {
+        case 0:
+            elem_tree_insert(tree, elem);
+            break;
+        case 1:
+            elem_tree_search(tree, elem);
+            break;
+        case 2:
+            elem_tree_remove(tree, elem);
+            break;
+        }
+    } else {
+        switch (kind) {
+        case 0:
+            rb_insert(tree, &elem->rb_node);
+            break;
+        case 1:
+            rb_search(tree, &elem->rb_node);
+            break;
+        case 2:
+            rb_remove(tree, &elem->rb_node);
+            break;
+        }
+    }
+}
+
+/*
+ * Run a single workload.
+ *
+ * The key space is [0, 2 * size). Every other key is inserted up front, so the
+ * tree starts with `size` elements and insertions and removals of random keys
+ * succeed about half of the time, which keeps the tree size roughly stable.
+ */
+static void
+bench(struct config *config) {
+    key_width = config->key_width;
+
+    size_t universe = 2 * config->size;
+    size_t elem_size = (sizeof(struct elem) + key_width + 7) & ~(size_t) 7;
+    unsigned char *pool = malloc(universe * elem_size);
+    assert(pool);
+
+#define ELEM(I) ((struct elem *) (pool + (size_t) (I) * elem_size))
+
+    for (size_t i = 0; i < universe; i += 1) {
+        set_key(ELEM(i), i);
+        ELEM(i)->rb_node = rb_node_init();
+    }
+
+    uint64_t state = config->seed | 1;
+
+    // Preload the tree. Sequential workloads insert in key order, the others
+    // in a random order.
+    size_t *order = malloc(config->size * sizeof(size_t));
+    assert(order);
+
+    for (size_t i = 0; i < config->size; i += 1) {
+        order[i] = 2 * i;
+    }
+
+    if (config->workload != SEQUENTIAL) {
+        for (size_t i = config->size - 1; i > 0; i -= 1) {
+            size_t j = next_random(&state) % (i + 1);
+            size_t tmp = order[i];
+            order[i] = order[j];
+            order[j] = tmp;
+        }
+    }
+
+    struct rb_tree tree = rb_tree_init(elem_tree_cmp);
+    for (size_t i = 0; i < config->size; i += 1) {
+        rb_insert(&tree, &ELEM(order[i])->rb_node);
+    }
+
+    free(order);
+
+    // Pre-generate the operation stream so that the generators stay out of the
+    // timed region.
+    struct zipf zipf;
+    if (config->workload == ZIPFIAN) {
+        zipf = zipf_init(universe, 0.99);
+    }
+
+    size_t *keys = malloc(config->ops * sizeof(size_t));
+    unsigned char *kinds = malloc(config->ops);
+    assert(keys && kinds);
+
+    for (size_t i = 0; i < config->ops; i += 1) {
+        switch (config->workload) {
+        case SEQUENTIAL:
+            keys[i] = i % universe;
+            break;
+        case RANDOM:
+            keys[i] = next_random(&state) % universe;
+            break;
+        case ZIPFIAN:
+            // Scatter the popular ranks across the key space.
+            keys[i] = (zipf_next(&zipf, &state) * 0x9e3779b97f4a7c15ULL) % universe;
+            break;
+        }
+
+        unsigned roll = next_random(&state) % 100;
+        if (roll < config->mix[0]) {
+            kinds[i] = 0;
+        } else if (roll < config->mix[0] + config->mix[1]) {
+            kinds[i] = 1;
+        } else {
+            kinds[i] = 2;
+        }
+    }
+
+    comparisons = 0;
+#ifdef RB_STATS
+    tree.stats = (struct rb_stats) {0};
+#endif
+
+    // Throughput is measured over an untimed pass, so that reading the clock
+    // for the latency samples doesn't slow the operations down.
+    uint64_t start = now();
+    for (size_t i = 0; i < config->ops; i += 1) {
+        run_op(config, &tree, ELEM(keys[i]), kinds[i]);
+    }
+
+    uint64_t elapsed = now() - start;
+    uint64_t compared = comparisons;
+#ifdef RB_STATS
+    struct rb_stats stats = tree.stats;
+#endif
+
+    // Latencies come from a second pass over the same operations, which keeps
+    // the tree at about the same size. Only every stride-th operation is timed
+    // individually so that the sample buffer stays bounded for large runs.
+    size_t stride = config->ops / MAX_SAMPLES + 1;
+    uint32_t *samples = malloc((config->ops / stride + 1) * sizeof(uint32_t));
+    assert(samples);
+    size_t nsamples = 0;
+
+    for (size_t i = 0; i < config->ops; i += stride) {
+        uint64_t before = now();
+        run_op(config, &tree, ELEM(keys[i]), kinds[i]);
+        samples[nsamples] = (uint32_t) (now() - before);
+        nsamples += 1;
+    }
+
+#undef ELEM
+
+    qsort(samples, nsamples, sizeof(uint32_t), cmp_u32);
+
+    double seconds = (double) elapsed / 1e9;
+    printf("%-3s %-6s %10zu %4u %3u:%3u:%3u %10zu %12.0f %8u %8u %8u %8.2f\n", config->generated ? "gen" : "rb",
+           workload_names[config->workload], config->size, config->key_width, config->mix[0], config->mix[1],
+           config->mix[2], config->ops, (double) config->ops / seconds, percentile(samples, nsamples, 0.50),
+           percentile(samples, nsamples, 0.99), percentile(samples, nsamples, 0.999),
+           (double) compared / (double) config->ops);
+
+    if (config->profile) {
+        struct rb_report report;
+        rb_profile(&tree, &report);
+        printf("    depth avg %.2f max %zu, black height %zu, red %.1f%%, line-local %.1f%%, page-local %.1f%%\n",
+               report.average_depth, report.max_depth, report.black_height,
+               100.0 * (double) report.red / (double) (report.nodes ? report.nodes : 1), 100.0 * report.line_local,
+               100.0 * report.page_local);
+    }
+
+#ifdef RB_STATS
+    // Rebalancing work for the throughput pass, from the tree's own counters.
+    printf("    rot/op %.3f (L %" PRIu64 " R %" PRIu64 "), insert cases %" PRIu64 "/%" PRIu64 "/%" PRIu64
+           ", remove cases %" PRIu64 "/%" PRIu64 "/%" PRIu64 "/%" PRIu64 ", max depth %" PRIu64 "\n",
+           (double) (stats.rotations[0] + stats.rotations[1]) / (double) config->ops, stats.rotations[0],
+           stats.rotations[1], stats.insert_cases[0], stats.insert_cases[1], stats.insert_cases[2],
+           stats.remove_cases[0], stats.remove_cases[1], stats.remove_cases[2], stats.remove_cases[3],
+           stats.max_depth);
+#endif
+
+    free(samples);
+    free(kinds);
+    free(keys);
+    free(pool);
+}
+
+// ----------------------------------------------------------------------------
+// Driver
+// ----------------------------------------------------------------------------
+
+static void
+usage(const char *name) {
+    fprintf(stderr,
+            "Usage: %s [-w seq|random|zipf] [-n size] [-o ops] [-k key width] [-m insert:search:remove] [-s seed] "
+            "[-g] [-p]\n"
+            "\n"
+            "Without -w or -n, every workload is run over sizes 1K, 10K, 100K, and 1M.\n"
+            "Key widths are in bytes, from 1 to %u.\n"
+            "With -g, the functions generated by RB_GENERATE() are used instead of rb_*.\n"
+            "With -p, the shape of the tree is reported after each run.\n",
+            name, MAX_KEY_WIDTH);
+}
+
+int
+main(int argc, char **argv) {
+    struct config config = {
+        .workload = RANDOM,
+        .size = 0,
+        .ops = 0,
+        .key_width = 8,
+        .mix = {25, 50, 25},
+        .seed = time(NULL),
+        .generated = false,
+        .profile = false,
+    };
+    bool all_workloads = true;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "w:n:o:k:m:s:gph")) != -1) {
+        switch (opt) {
+        case 'w':
+            all_workloads = false;
+            if (strcmp(optarg, "seq") == 0) {
+                config.workload = SEQUENTIAL;
+            } else if (strcmp(optarg, "random") == 0) {
+                config.workload = RANDOM;
+            } else if (strcmp(optarg, "zipf") == 0) {
+                config.workload = ZIPFIAN;
+            } else {
+                usage(argv[0]);
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'n':
+            config.size = strtoull(optarg, NULL, 10);
+            break;
+        case 'o':
+            config.ops = strtoull(optarg, NULL, 10);
+            break;
+        case 'k':
+            config.key_width = strtoul(optarg, NULL, 10);
+            break;
+        case 'm':
+            if (sscanf(optarg, "%u:%u:%u", &config.mix[0], &config.mix[1], &config.mix[2]) != 3 ||
+                config.mix[0] + config.mix[1] + config.mix[2] != 100) {
+                fprintf(stderr, "The operation mix must add up to 100\n");
+                return EXIT_FAILURE;
+            }
+            break;
+        case 's':
+            config.seed = strtoul(optarg, NULL, 10);
+            break;
+        case 'g':
+            config.generated = true;
+            break;
+        case 'p':
+            config.profile = true;
+            break;
+        default:
+            usage(argv[0]);
+            return opt == 'h' ? EXIT_SUCCESS : EXIT_FAILURE;
+        }
+    }
+
+    if (config.key_width == 0 || config.key_width > MAX_KEY_WIDTH) {
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    size_t sizes[] = {1000, 10000, 100000, 1000000};
+    size_t nsizes = sizeof(sizes) / sizeof(sizes[0]);
+    if (config.size != 0) {
+        sizes[0] = config.size;
+        nsizes = 1;
+    }
+
+    bool default_ops = config.ops == 0;
+
+    printf("%-3s %-6s %10s %4s %11s %10s %12s %8s %8s %8s %8s\n", "api", "load", "size", "keyw", "mix", "ops",
+           "ops/sec", "p50(ns)", "p99(ns)", "p999(ns)", "cmp/op");
+
+    for (size_t i = 0; i < nsizes; i += 1) {
+        config.size = sizes[i];
+        if (default_ops) {
+            config.ops = config.size < 1000000 ? 1000000 : config.size;
+        }
+
+        for (int w = SEQUENTIAL; w <= ZIPFIAN; w += 1) {
+            if (!all_workloads && (enum workload) w != config.workload) {
+                continue;
+            }
+
+            enum workload selected = config.workload;
+            config.workload = w;
+            bench(&config);
+            config.workload = selected;
+        }
+    }
+
+    return EXIT_SUCCESS;
+}
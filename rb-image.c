@@ -0,0 +1,229 @@
+#include "rb-image.h"
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define RB_IMAGE_MAGIC "RBIMAGE1"
+#define RB_IMAGE_BYTE_ORDER UINT64_C(0x0102030405060708)
+
+/*
+ * Records start at an offset that is a multiple of this, and are a multiple of
+ * it in size, so that their data is aligned for any type.
+ */
+#define RB_IMAGE_ALIGN 16
+
+#define ALIGN_UP(SIZE) (((SIZE) + RB_IMAGE_ALIGN - 1) & ~(size_t) (RB_IMAGE_ALIGN - 1))
+#define HEADER_SIZE ALIGN_UP(sizeof(struct rb_image_header))
+#define DATA_OFFSET ALIGN_UP(sizeof(struct rb_image_node))
+
+#define RECORD_AT(BASE, OFFSET) ((struct rb_image_node *) ((unsigned char *) (BASE) + (OFFSET)))
+#define DATA_OF(RECORD) ((unsigned char *) (RECORD) + DATA_OFFSET)
+#define RECORD_OF(DATA) ((const struct rb_image_node *) ((const unsigned char *) (DATA) - DATA_OFFSET))
+
+// -----------------------------------------------------------------------------
+// Writing
+// -----------------------------------------------------------------------------
+
+struct rb_image_writer {
+    unsigned char *buffer;
+    size_t record_size;
+    size_t data_size;
+    rb_image_encode encode;
+    uint64_t next;
+};
+
+/*
+ * Write the records of a subtree in order, and return the offset of the
+ * subtree's root, or 0 if it is empty. Each record's parent is filled in by
+ * the parent itself, once its offset is known.
+ */
+static uint64_t
+rb_image_write_subtree(struct rb_image_writer *writer, struct rb_node *node) {
+    if (!node) {
+        return 0;
+    }
+
+    uint64_t left = rb_image_write_subtree(writer, node->left);
+
+    uint64_t offset = writer->next;
+    writer->next += writer->record_size;
+
+    uint64_t right = rb_image_write_subtree(writer, node->right);
+
+    struct rb_image_node *record = RECORD_AT(writer->buffer, offset);
+    record->left = left;
+    record->right = right;
+
+    // Keep the color, which is in the same bit as in struct rb_node.
+    record->parent = (record->parent & ~(uint64_t) 1) | (node->parent & 1);
+    if (left) {
+        RECORD_AT(writer->buffer, left)->parent = offset | (RECORD_AT(writer->buffer, left)->parent & 1);
+    }
+
+    if (right) {
+        RECORD_AT(writer->buffer, right)->parent = offset | (RECORD_AT(writer->buffer, right)->parent & 1);
+    }
+
+    writer->encode(node, DATA_OF(record), writer->data_size);
+    return offset;
+}
+
+bool
+rb_image_write(struct rb_tree *tree, const char *path, size_t data_size, rb_image_encode encode) {
+    size_t count = 0;
+    struct rb_node *node = NULL;
+    rb_for_each(*tree, node) {
+        count += 1;
+    }
+
+    // The image is put together in memory, since a record's links aren't
+    // known until its subtrees have been laid out, and written in one go.
+    size_t record_size = ALIGN_UP(DATA_OFFSET + data_size);
+    size_t size = HEADER_SIZE + count * record_size;
+    unsigned char *buffer = calloc(1, size);
+    if (!buffer) {
+        return false;
+    }
+
+    struct rb_image_writer writer = {buffer, record_size, data_size, encode, HEADER_SIZE};
+    uint64_t root = rb_image_write_subtree(&writer, tree->root);
+
+    struct rb_image_header *header = (struct rb_image_header *) buffer;
+    memcpy(header->magic, RB_IMAGE_MAGIC, sizeof(header->magic));
+    header->byte_order = RB_IMAGE_BYTE_ORDER;
+    header->count = count;
+    header->data_size = data_size;
+    header->record_size = record_size;
+    header->root = root;
+    header->first = count ? HEADER_SIZE : 0;
+    header->last = count ? HEADER_SIZE + (count - 1) * record_size : 0;
+
+    FILE *file = fopen(path, "wb");
+    bool written = file && fwrite(buffer, 1, size, file) == size;
+    if (file && fclose(file) != 0) {
+        written = false;
+    }
+
+    free(buffer);
+    return written;
+}
+
+// -----------------------------------------------------------------------------
+// Reading
+// -----------------------------------------------------------------------------
+
+/*
+ * Return true if an offset is 0 or starts one of the header's records, all of
+ * which are known to lie within the image.
+ */
+static bool
+rb_image_record_is_valid(const struct rb_image_header *header, uint64_t offset) {
+    if (offset == 0) {
+        return true;
+    }
+
+    return offset >= HEADER_SIZE && (offset - HEADER_SIZE) % header->record_size == 0 &&
+           (offset - HEADER_SIZE) / header->record_size < header->count;
+}
+
+bool
+rb_image_open(struct rb_image *image, const char *path) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return false;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (size_t) st.st_size < HEADER_SIZE) {
+        close(fd);
+        return false;
+    }
+
+    // The mapping stays valid after the file is closed.
+    size_t size = (size_t) st.st_size;
+    void *base = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED) {
+        return false;
+    }
+
+    const struct rb_image_header *header = base;
+    // The data size is checked by subtraction, which can't wrap around.
+    if (memcmp(header->magic, RB_IMAGE_MAGIC, sizeof(header->magic)) != 0 ||
+        header->byte_order != RB_IMAGE_BYTE_ORDER || header->record_size < DATA_OFFSET ||
+        header->data_size > header->record_size - DATA_OFFSET || header->record_size % RB_IMAGE_ALIGN != 0 ||
+        (size - HEADER_SIZE) / header->record_size < header->count || !rb_image_record_is_valid(header, header->root) ||
+        !rb_image_record_is_valid(header, header->first) || !rb_image_record_is_valid(header, header->last)) {
+        munmap(base, size);
+        return false;
+    }
+
+    image->base = base;
+    image->size = size;
+    image->header = header;
+    return true;
+}
+
+void
+rb_image_close(struct rb_image *image) {
+    munmap((void *) image->base, image->size);
+    image->base = NULL;
+    image->size = 0;
+    image->header = NULL;
+}
+
+const void *
+rb_image_search(struct rb_image *image, const void *key, rb_image_cmp cmp) {
+    uint64_t curr = image->header->root;
+    while (curr) {
+        const struct rb_image_node *record = RECORD_AT(image->base, curr);
+        int result = cmp(key, DATA_OF(record));
+
+        if (result == 0) {
+            return DATA_OF(record);
+        }
+
+        curr = result < 0 ? record->left : record->right;
+    }
+
+    return NULL;
+}
+
+const void *
+rb_image_first(struct rb_image *image) {
+    uint64_t first = image->header->first;
+    return first ? DATA_OF(RECORD_AT(image->base, first)) : NULL;
+}
+
+const void *
+rb_image_last(struct rb_image *image) {
+    uint64_t last = image->header->last;
+    return last ? DATA_OF(RECORD_AT(image->base, last)) : NULL;
+}
+
+const void *
+rb_image_next(struct rb_image *image, const void *data) {
+    const struct rb_image_node *record = RECORD_OF(data);
+    if ((const unsigned char *) record == image->base + image->header->last) {
+        return NULL;
+    }
+
+    return (const unsigned char *) data + image->header->record_size;
+}
+
+const void *
+rb_image_prev(struct rb_image *image, const void *data) {
+    const struct rb_image_node *record = RECORD_OF(data);
+    if ((const unsigned char *) record == image->base + image->header->first) {
+        return NULL;
+    }
+
+    return (const unsigned char *) data - image->header->record_size;
+}
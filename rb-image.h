@@ -0,0 +1,111 @@
+#ifndef RB_IMAGE_H
+#define RB_IMAGE_H
+
+#include "rb.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * A snapshot of a tree in a flat, position-independent file, which can be
+ * mapped into memory and searched and iterated right away, without rebuilding
+ * the tree.
+ *
+ * The image holds a header and then one record per node, in key order. Each
+ * record has the node's links, as offsets from the start of the image with the
+ * color in the lowest bit of the parent, followed by a fixed-size copy of the
+ * element's data, written by a callback. Images use the byte order and word
+ * size of the machine that wrote them, and are rejected elsewhere.
+ */
+
+/*
+ * Write the data of the element containing a node, `size` bytes, to `data`.
+ */
+typedef void (*rb_image_encode)(struct rb_node *node, void *data, size_t size);
+
+/*
+ * Compare a search key with the data of a record, like rb_cmp.
+ */
+typedef int (*rb_image_cmp)(const void *key, const void *data);
+
+struct rb_image_header {
+    char magic[8];
+    uint64_t byte_order;
+    uint64_t count;
+    uint64_t data_size;
+    uint64_t record_size;
+    uint64_t root;
+    uint64_t first;
+    uint64_t last;
+};
+
+struct rb_image_node {
+    uint64_t parent;
+    uint64_t left;
+    uint64_t right;
+};
+
+/*
+ * A mapped image.
+ */
+struct rb_image {
+    const unsigned char *base;
+    size_t size;
+    const struct rb_image_header *header;
+};
+
+/*
+ * Write a tree to an image file, with `data_size` bytes of data per element.
+ * Return false if the file could not be written.
+ */
+bool rb_image_write(struct rb_tree *tree, const char *path, size_t data_size, rb_image_encode encode);
+
+/*
+ * Map an image file read-only. Return false if it could not be mapped, its
+ * header doesn't match its size, or the header's offsets aren't records. The
+ * records themselves are trusted.
+ */
+bool rb_image_open(struct rb_image *image, const char *path);
+
+/*
+ * Unmap an image. Pointers into it are no longer valid.
+ */
+void rb_image_close(struct rb_image *image);
+
+/*
+ * Return the number of records in an image.
+ */
+static inline size_t
+rb_image_count(struct rb_image *image) {
+    return image->header->count;
+}
+
+/*
+ * Return the data of the record equal to the key, or NULL if there is none.
+ */
+const void *rb_image_search(struct rb_image *image, const void *key, rb_image_cmp cmp);
+
+/*
+ * Return the data of the first record, or NULL if the image is empty.
+ */
+const void *rb_image_first(struct rb_image *image);
+
+/*
+ * Return the data of the last record, or NULL if the image is empty.
+ */
+const void *rb_image_last(struct rb_image *image);
+
+/*
+ * Return the data of the record after the given one, or NULL if it is the
+ * last. Records are stored in order, so this is a single addition.
+ */
+const void *rb_image_next(struct rb_image *image, const void *data);
+
+/*
+ * Return the data of the record before the given one, or NULL if it is the
+ * first.
+ */
+const void *rb_image_prev(struct rb_image *image, const void *data);
+
+#endif
@@ -0,0 +1,166 @@
+#include "rb-interval.h"
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#define INTERVAL_OF(NODE) rb_entry(NODE, struct rb_interval, rb_node)
+#define MAX_OF(NODE) ((NODE) ? INTERVAL_OF(NODE)->max : 0)
+
+/*
+ * Order intervals by start, then by end. Intervals with the same bounds are
+ * ordered by address, so that they can all be in the tree at once.
+ */
+static inline int
+rb_interval_order(struct rb_interval *left, struct rb_interval *right) {
+    if (left->start != right->start) {
+        return left->start < right->start ? -1 : 1;
+    }
+
+    if (left->end != right->end) {
+        return left->end < right->end ? -1 : 1;
+    }
+
+    return (left > right) - (left < right);
+}
+
+static int
+rb_interval_cmp(struct rb_node *left, struct rb_node *right) {
+    return rb_interval_order(INTERVAL_OF(left), INTERVAL_OF(right));
+}
+
+static inline uint64_t
+rb_interval_compute(struct rb_interval *interval) {
+    uint64_t max = interval->end;
+    if (MAX_OF(interval->rb_node.left) > max) {
+        max = MAX_OF(interval->rb_node.left);
+    }
+
+    if (MAX_OF(interval->rb_node.right) > max) {
+        max = MAX_OF(interval->rb_node.right);
+    }
+
+    return max;
+}
+
+RB_DECLARE_AUGMENT(rb_interval_augment, struct rb_interval, rb_node, max, rb_interval_compute);
+
+struct rb_tree
+rb_interval_tree_init(void) {
+    return rb_tree_init_augmented(rb_interval_cmp, &rb_interval_augment);
+}
+
+struct rb_interval
+rb_interval_init(uint64_t start, uint64_t end) {
+    struct rb_interval interval;
+    interval.start = start;
+    interval.end = end;
+    interval.max = end;
+    interval.rb_node = rb_node_init();
+    return interval;
+}
+
+void
+rb_interval_insert(struct rb_tree *tree, struct rb_interval *interval) {
+    // Since no two intervals are equal, the descent always ends at a leaf.
+    struct rb_node *parent = NULL;
+    struct rb_node **link = &tree->root;
+    while (*link) {
+        parent = *link;
+        link = rb_interval_order(interval, INTERVAL_OF(parent)) < 0 ? &parent->left : &parent->right;
+    }
+
+    rb_link_node(&interval->rb_node, parent, link);
+    rb_insert_color(tree, &interval->rb_node);
+}
+
+void
+rb_interval_remove(struct rb_tree *tree, struct rb_interval *interval) {
+    rb_erase(tree, &interval->rb_node);
+}
+
+// -----------------------------------------------------------------------------
+// Overlap queries
+// -----------------------------------------------------------------------------
+
+/*
+ * Return the interval with the lowest start in the subtree rooted at `node`
+ * that overlaps [start, end), or NULL if there is none.
+ */
+static struct rb_interval *
+rb_interval_subtree_search(struct rb_node *node, uint64_t start, uint64_t end) {
+    while (true) {
+        // The left subtree holds the lowest starts, so prefer it whenever some
+        // interval in it ends after the query starts.
+        if (node->left && start < MAX_OF(node->left)) {
+            node = node->left;
+            continue;
+        }
+
+        struct rb_interval *interval = INTERVAL_OF(node);
+
+        // Everything from here on starts at or after this interval does.
+        if (interval->start >= end) {
+            return NULL;
+        }
+
+        if (start < interval->end) {
+            return interval;
+        }
+
+        if (node->right && start < MAX_OF(node->right)) {
+            node = node->right;
+            continue;
+        }
+
+        return NULL;
+    }
+}
+
+struct rb_interval *
+rb_interval_first(struct rb_tree *tree, uint64_t start, uint64_t end) {
+    if (!tree->root || start >= end) {
+        return NULL;
+    }
+
+    // Bail out early if everything ends too early or starts too late.
+    if (MAX_OF(tree->root) <= start || INTERVAL_OF(tree->first)->start >= end) {
+        return NULL;
+    }
+
+    return rb_interval_subtree_search(tree->root, start, end);
+}
+
+struct rb_interval *
+rb_interval_next(struct rb_interval *interval, uint64_t start, uint64_t end) {
+    struct rb_node *node = &interval->rb_node;
+    struct rb_node *right = node->right;
+
+    while (true) {
+        // Everything in the right subtree comes next. If nothing in it overlaps,
+        // then nothing after it does either.
+        if (right && start < MAX_OF(right)) {
+            return rb_interval_subtree_search(right, start, end);
+        }
+
+        // Climb until arriving from a left child. That ancestor comes next.
+        struct rb_node *prev = NULL;
+        do {
+            prev = node;
+            node = rb_parent(node);
+            if (!node) {
+                return NULL;
+            }
+
+            right = node->right;
+        } while (prev == right);
+
+        interval = INTERVAL_OF(node);
+        if (interval->start >= end) {
+            return NULL;
+        }
+
+        if (start < interval->end) {
+            return interval;
+        }
+    }
+}
@@ -0,0 +1,61 @@
+#ifndef RB_INTERVAL_H
+#define RB_INTERVAL_H
+
+#include "rb.h"
+
+#include <stdint.h>
+
+#define rb_interval_for_each(TREE, INTERVAL, START, END)                                                               \
+    for ((INTERVAL) = rb_interval_first((TREE), (START), (END)); (INTERVAL) != NULL;                                  \
+         (INTERVAL) = rb_interval_next((INTERVAL), (START), (END)))
+
+/*
+ * A half-open interval, [start, end), in an interval tree. Intervals are
+ * ordered by start, and each one keeps the greatest end in its subtree so that
+ * overlap queries can skip subtrees that end too early.
+ *
+ * Intervals must not be empty, so start must be less than end. Any number of
+ * intervals may share the same bounds.
+ */
+struct rb_interval {
+    uint64_t start;
+    uint64_t end;
+    uint64_t max;
+    struct rb_node rb_node;
+};
+
+/*
+ * Return a new interval tree. Intervals must only be added to and taken out of
+ * it with rb_interval_insert() and rb_interval_remove().
+ */
+struct rb_tree rb_interval_tree_init(void);
+
+/*
+ * Return a new interval, [start, end), which is not linked into any tree.
+ */
+struct rb_interval rb_interval_init(uint64_t start, uint64_t end);
+
+/*
+ * Insert an interval into an interval tree.
+ */
+void rb_interval_insert(struct rb_tree *tree, struct rb_interval *interval);
+
+/*
+ * Remove an interval that is in the interval tree.
+ */
+void rb_interval_remove(struct rb_tree *tree, struct rb_interval *interval);
+
+/*
+ * Return the interval with the lowest start that overlaps [start, end), or
+ * NULL if there is none, in O(log n). An empty query overlaps nothing.
+ */
+struct rb_interval *rb_interval_first(struct rb_tree *tree, uint64_t start, uint64_t end);
+
+/*
+ * Return the next interval after the given one that overlaps [start, end), or
+ * NULL if there is none. Visiting all k overlapping intervals takes
+ * O(log n + k) altogether.
+ */
+struct rb_interval *rb_interval_next(struct rb_interval *interval, uint64_t start, uint64_t end);
+
+#endif
@@ -0,0 +1,122 @@
+#include "rb-latch.h"
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// The links for copy i are rb_node[i], so stepping back i nodes finds rb_node[0].
+#define LATCH_OF(NODE, INDEX) ((struct rb_latch_node *) ((NODE) - (INDEX)))
+// Readers load links with relaxed atomic loads, which pair with the relaxed
+// stores that rb_link_node(), rb_insert_color(), and rb_erase() use for them.
+#define LOAD(FIELD) __atomic_load_n(&(FIELD), __ATOMIC_RELAXED)
+
+struct rb_latch_tree
+rb_latch_tree_init(rb_latch_cmp cmp) {
+    struct rb_latch_tree tree;
+    tree.seq = 0;
+
+    // The copies are only updated through rb_link_node(), rb_insert_color(),
+    // and rb_erase(), which never compare nodes.
+    tree.tree[0] = rb_tree_init(NULL);
+    tree.tree[1] = rb_tree_init(NULL);
+    tree.cmp = cmp;
+    return tree;
+}
+
+struct rb_latch_node
+rb_latch_node_init(void) {
+    struct rb_latch_node node;
+    node.rb_node[0] = rb_node_init();
+    node.rb_node[1] = rb_node_init();
+    return node;
+}
+
+/*
+ * Steer readers to the other copy. Stores before the latch are visible before
+ * it, and the latch is visible before any store after it.
+ */
+static inline void
+rb_latch(struct rb_latch_tree *tree) {
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    __atomic_store_n(&tree->seq, tree->seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+/*
+ * Insert a node into one copy, which no reader is looking at.
+ */
+static void
+rb_latch_insert_copy(struct rb_latch_tree *tree, struct rb_latch_node *node, unsigned index) {
+    struct rb_node *parent = NULL;
+    struct rb_node **link = &tree->tree[index].root;
+    while (*link) {
+        parent = *link;
+        link = tree->cmp(node, LATCH_OF(parent, index)) < 0 ? &parent->left : &parent->right;
+    }
+
+    rb_link_node(&node->rb_node[index], parent, link);
+    rb_insert_color(&tree->tree[index], &node->rb_node[index]);
+}
+
+bool
+rb_latch_insert(struct rb_latch_tree *tree, struct rb_latch_node *node) {
+    // Writers are serialized, so both copies hold the same nodes here.
+    struct rb_node *curr = tree->tree[0].root;
+    while (curr) {
+        int result = tree->cmp(node, LATCH_OF(curr, 0));
+        if (result == 0) {
+            return false;
+        }
+
+        curr = result < 0 ? curr->left : curr->right;
+    }
+
+    rb_latch(tree);
+    rb_latch_insert_copy(tree, node, 0);
+    rb_latch(tree);
+    rb_latch_insert_copy(tree, node, 1);
+    return true;
+}
+
+void
+rb_latch_erase(struct rb_latch_tree *tree, struct rb_latch_node *node) {
+    rb_latch(tree);
+    rb_erase(&tree->tree[0], &node->rb_node[0]);
+    rb_latch(tree);
+    rb_erase(&tree->tree[1], &node->rb_node[1]);
+}
+
+/*
+ * Search one copy, which might be changing underneath. Return NULL if the
+ * search got lost, which the sequence check will catch.
+ */
+static struct rb_latch_node *
+rb_latch_search_copy(struct rb_latch_tree *tree, struct rb_latch_node *key, unsigned index) {
+    struct rb_node *curr = LOAD(tree->tree[index].root);
+    // No tree is taller than RB_MAX_HEIGHT, so a search that descends further
+    // must have followed links that were being rewritten.
+    for (size_t depth = 0; curr && depth < RB_MAX_HEIGHT; depth += 1) {
+        struct rb_latch_node *node = LATCH_OF(curr, index);
+        int result = tree->cmp(key, node);
+        if (result == 0) {
+            return node;
+        }
+
+        curr = result < 0 ? LOAD(curr->left) : LOAD(curr->right);
+    }
+
+    return NULL;
+}
+
+struct rb_latch_node *
+rb_latch_search(struct rb_latch_tree *tree, struct rb_latch_node *key) {
+    unsigned seq;
+    struct rb_latch_node *node;
+
+    do {
+        seq = __atomic_load_n(&tree->seq, __ATOMIC_ACQUIRE);
+        node = rb_latch_search_copy(tree, key, seq & 1);
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    } while (__atomic_load_n(&tree->seq, __ATOMIC_RELAXED) != seq);
+
+    return node;
+}
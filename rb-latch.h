@@ -0,0 +1,72 @@
+#ifndef RB_LATCH_H
+#define RB_LATCH_H
+
+#include "rb.h"
+
+#include <stdbool.h>
+
+/*
+ * A latch tree keeps two red-black trees over the same elements, and lets
+ * readers search them without locks while a writer updates them, in the style
+ * of Linux's latch_tree.
+ *
+ * Each update is applied to one copy while readers are steered to the other by
+ * a sequence counter, and then to the second copy once readers have been
+ * steered back. A search never writes to shared memory. It only retries if an
+ * update finished while it was running, so readers scale with the number of
+ * cores as long as updates are rare.
+ *
+ * Writers must be serialized by the caller, for example with a mutex. Elements
+ * must not be freed or have their keys changed while a search might still see
+ * them, which means after removal until every search that started before it
+ * has returned.
+ */
+struct rb_latch_node {
+    struct rb_node rb_node[2];
+};
+
+/*
+ * Compare two latch nodes, like rb_cmp. It may be called on a node that is
+ * concurrently being removed, so it must only look at the immutable key.
+ */
+typedef int (*rb_latch_cmp)(struct rb_latch_node *left, struct rb_latch_node *right);
+
+struct rb_latch_tree {
+    unsigned seq;
+    struct rb_tree tree[2];
+    rb_latch_cmp cmp;
+};
+
+/*
+ * Return a new latch tree.
+ */
+struct rb_latch_tree rb_latch_tree_init(rb_latch_cmp cmp);
+
+/*
+ * Return a new latch node. The node is not linked into any tree.
+ */
+struct rb_latch_node rb_latch_node_init(void);
+
+/*
+ * Insert a node into the tree. If an equal node is already in the tree, then
+ * return false and leave the tree unchanged, else return true.
+ *
+ * This must not run at the same time as any other update of the same tree.
+ */
+bool rb_latch_insert(struct rb_latch_tree *tree, struct rb_latch_node *node);
+
+/*
+ * Remove a node that is in the tree.
+ *
+ * This must not run at the same time as any other update of the same tree.
+ */
+void rb_latch_erase(struct rb_latch_tree *tree, struct rb_latch_node *node);
+
+/*
+ * If a node equal to the key is in the tree, then return it, else return NULL.
+ *
+ * This may run at the same time as an update, and takes no locks.
+ */
+struct rb_latch_node *rb_latch_search(struct rb_latch_tree *tree, struct rb_latch_node *key);
+
+#endif
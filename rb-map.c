@@ -0,0 +1,215 @@
+#include "rb-map.h"
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define RB_MAP_MIN_SLAB 64
+#define RB_MAP_MAX_SLAB 65536
+
+#define ALIGN_UP(SIZE, ALIGN) (((SIZE) + (ALIGN) - 1) & ~((ALIGN) - 1))
+#define KEY_OF(MAP, ENTRY) ((unsigned char *) (ENTRY) + (MAP)->key_offset)
+#define VALUE_OF(MAP, ENTRY) ((unsigned char *) (ENTRY) + (MAP)->value_offset)
+#define ENTRY_OF(NODE) rb_entry(NODE, struct rb_map_entry, rb_node)
+
+struct rb_map_slab {
+    struct rb_map_slab *next;
+    size_t capacity;
+    _Alignas(max_align_t) unsigned char entries[];
+};
+
+/*
+ * Return the alignment needed by any type of the given size. A type's
+ * alignment always divides its size, so this is the largest power of two that
+ * does, up to that of max_align_t.
+ */
+static size_t
+rb_map_align(size_t size) {
+    size_t align = size & -size;
+    if (align == 0 || align > _Alignof(max_align_t)) {
+        align = _Alignof(max_align_t);
+    }
+
+    return align;
+}
+
+struct rb_map
+rb_map_init(size_t key_size, size_t value_size, rb_map_cmp cmp) {
+    size_t key_align = rb_map_align(key_size);
+    size_t value_align = rb_map_align(value_size);
+    size_t entry_align = _Alignof(struct rb_map_entry);
+    entry_align = key_align > entry_align ? key_align : entry_align;
+    entry_align = value_align > entry_align ? value_align : entry_align;
+
+    struct rb_map map;
+    map.tree = rb_tree_init(NULL);
+    map.cmp = cmp;
+    map.size = 0;
+    map.key_offset = ALIGN_UP(sizeof(struct rb_map_entry), key_align);
+    map.key_size = key_size;
+    map.value_offset = ALIGN_UP(map.key_offset + key_size, value_align);
+    map.value_size = value_size;
+    map.entry_size = ALIGN_UP(map.value_offset + value_size, entry_align);
+    map.slabs = NULL;
+    map.free = NULL;
+    map.unused = NULL;
+    map.end = NULL;
+    return map;
+}
+
+// -----------------------------------------------------------------------------
+// Allocation
+// -----------------------------------------------------------------------------
+
+static struct rb_map_entry *
+rb_map_alloc(struct rb_map *map) {
+    // Freed entries are chained through their left links.
+    if (map->free) {
+        struct rb_map_entry *entry = map->free;
+        map->free = (struct rb_map_entry *) entry->rb_node.left;
+        return entry;
+    }
+
+    if (map->unused == map->end) {
+        // Each slab is twice the size of the last, up to a limit, so small
+        // maps stay small and large ones need few slabs.
+        size_t capacity = map->slabs ? 2 * map->slabs->capacity : RB_MAP_MIN_SLAB;
+        if (capacity > RB_MAP_MAX_SLAB) {
+            capacity = RB_MAP_MAX_SLAB;
+        }
+
+        struct rb_map_slab *slab = malloc(sizeof(struct rb_map_slab) + capacity * map->entry_size);
+        if (!slab) {
+            return NULL;
+        }
+
+        slab->next = map->slabs;
+        slab->capacity = capacity;
+        map->slabs = slab;
+        map->unused = slab->entries;
+        map->end = slab->entries + capacity * map->entry_size;
+    }
+
+    struct rb_map_entry *entry = (struct rb_map_entry *) map->unused;
+    map->unused += map->entry_size;
+    return entry;
+}
+
+static void
+rb_map_free(struct rb_map *map, struct rb_map_entry *entry) {
+    entry->rb_node.left = (struct rb_node *) map->free;
+    map->free = entry;
+}
+
+void
+rb_map_clear(struct rb_map *map) {
+    while (map->slabs) {
+        struct rb_map_slab *next = map->slabs->next;
+        free(map->slabs);
+        map->slabs = next;
+    }
+
+    map->tree = rb_tree_init(NULL);
+    map->size = 0;
+    map->free = NULL;
+    map->unused = NULL;
+    map->end = NULL;
+}
+
+// -----------------------------------------------------------------------------
+// Operations
+// -----------------------------------------------------------------------------
+
+/*
+ * Return the entry with the given key, or NULL if there is none. If `parent`
+ * and `link` are given, they are set up for rb_link_node() in case there is
+ * none.
+ */
+static struct rb_map_entry *
+rb_map_find(struct rb_map *map, const void *key, struct rb_node **parent, struct rb_node ***link) {
+    struct rb_node *prev = NULL;
+    struct rb_node **curr = &map->tree.root;
+    while (*curr) {
+        int result = map->cmp(key, KEY_OF(map, ENTRY_OF(*curr)));
+        if (result == 0) {
+            return ENTRY_OF(*curr);
+        }
+
+        prev = *curr;
+        curr = result < 0 ? &prev->left : &prev->right;
+    }
+
+    if (parent) {
+        *parent = prev;
+        *link = curr;
+    }
+
+    return NULL;
+}
+
+void *
+rb_map_put(struct rb_map *map, const void *key, const void *value) {
+    struct rb_node *parent = NULL;
+    struct rb_node **link = NULL;
+    struct rb_map_entry *entry = rb_map_find(map, key, &parent, &link);
+
+    if (!entry) {
+        entry = rb_map_alloc(map);
+        if (!entry) {
+            return NULL;
+        }
+
+        memcpy(KEY_OF(map, entry), key, map->key_size);
+        rb_link_node(&entry->rb_node, parent, link);
+        rb_insert_color(&map->tree, &entry->rb_node);
+        map->size += 1;
+    }
+
+    memcpy(VALUE_OF(map, entry), value, map->value_size);
+    return VALUE_OF(map, entry);
+}
+
+void *
+rb_map_get(struct rb_map *map, const void *key) {
+    struct rb_map_entry *entry = rb_map_find(map, key, NULL, NULL);
+    return entry ? VALUE_OF(map, entry) : NULL;
+}
+
+bool
+rb_map_del(struct rb_map *map, const void *key) {
+    struct rb_map_entry *entry = rb_map_find(map, key, NULL, NULL);
+    if (!entry) {
+        return false;
+    }
+
+    rb_erase(&map->tree, &entry->rb_node);
+    rb_map_free(map, entry);
+    map->size -= 1;
+    return true;
+}
+
+// -----------------------------------------------------------------------------
+// Iteration
+// -----------------------------------------------------------------------------
+
+struct rb_map_entry *
+rb_map_first(struct rb_map *map) {
+    return map->tree.first ? ENTRY_OF(map->tree.first) : NULL;
+}
+
+struct rb_map_entry *
+rb_map_next(struct rb_map_entry *entry) {
+    struct rb_node *next = rb_next(&entry->rb_node);
+    return next ? ENTRY_OF(next) : NULL;
+}
+
+const void *
+rb_map_key(struct rb_map *map, struct rb_map_entry *entry) {
+    return KEY_OF(map, entry);
+}
+
+void *
+rb_map_value(struct rb_map *map, struct rb_map_entry *entry) {
+    return VALUE_OF(map, entry);
+}
@@ -0,0 +1,103 @@
+#ifndef RB_MAP_H
+#define RB_MAP_H
+
+#include "rb.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#define rb_map_for_each(MAP, ENTRY) for ((ENTRY) = rb_map_first(MAP); (ENTRY) != NULL; (ENTRY) = rb_map_next(ENTRY))
+
+/*
+ * An ordered map that owns copies of its keys and values, for when an
+ * intrusive tree is more trouble than it is worth.
+ *
+ * Keys and values have a fixed size per map, and are stored next to the node
+ * in entries of a single size. Entries are carved out of slabs that grow
+ * geometrically, and removed entries go on a free list for reuse, so most
+ * insertions don't call malloc() at all. All of the memory is released at once
+ * by rb_map_clear().
+ */
+
+/*
+ * Compare two keys, like the comparison function passed to qsort().
+ */
+typedef int (*rb_map_cmp)(const void *left, const void *right);
+
+struct rb_map_entry {
+    struct rb_node rb_node;
+};
+
+struct rb_map_slab;
+
+struct rb_map {
+    struct rb_tree tree;
+    rb_map_cmp cmp;
+    size_t size;
+
+    // The layout of an entry, which holds the node, then the key, then the
+    // value, each aligned for any type of its size.
+    size_t key_offset;
+    size_t key_size;
+    size_t value_offset;
+    size_t value_size;
+    size_t entry_size;
+
+    // Entries are taken from the free list, else from the unused end of the
+    // newest slab.
+    struct rb_map_slab *slabs;
+    struct rb_map_entry *free;
+    unsigned char *unused;
+    unsigned char *end;
+};
+
+/*
+ * Return a new, empty map with keys and values of the given sizes.
+ */
+struct rb_map rb_map_init(size_t key_size, size_t value_size, rb_map_cmp cmp);
+
+/*
+ * Set the value of a key, adding the key if it isn't in the map already, and
+ * return a pointer to the stored value. Return NULL if memory could not be
+ * allocated.
+ */
+void *rb_map_put(struct rb_map *map, const void *key, const void *value);
+
+/*
+ * Return a pointer to the value of a key, or NULL if it isn't in the map.
+ */
+void *rb_map_get(struct rb_map *map, const void *key);
+
+/*
+ * Remove a key and its value. Return true if it was in the map, else false.
+ */
+bool rb_map_del(struct rb_map *map, const void *key);
+
+/*
+ * Remove every key and release all of the map's memory, in O(number of slabs).
+ * The map can be used again afterwards.
+ */
+void rb_map_clear(struct rb_map *map);
+
+/*
+ * Return the entry with the least key, or NULL if the map is empty.
+ */
+struct rb_map_entry *rb_map_first(struct rb_map *map);
+
+/*
+ * Return the entry after the given one in key order, or NULL if it is the
+ * last.
+ */
+struct rb_map_entry *rb_map_next(struct rb_map_entry *entry);
+
+/*
+ * Return a pointer to the key of an entry.
+ */
+const void *rb_map_key(struct rb_map *map, struct rb_map_entry *entry);
+
+/*
+ * Return a pointer to the value of an entry.
+ */
+void *rb_map_value(struct rb_map *map, struct rb_map_entry *entry);
+
+#endif
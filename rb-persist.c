@@ -0,0 +1,497 @@
+#include "rb-persist.h"
+#include <assert.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+// The most nodes an update creates or copies for each level of its descent.
+#define RB_PERSIST_COPIES 4
+
+#define ALIGN_UP(SIZE, ALIGN) (((SIZE) + (ALIGN) - 1) & ~((ALIGN) - 1))
+#define IS_RED(NODE) ((NODE) && (NODE)->red)
+#define KEY_OF(NODE) ((NODE)->data)
+#define VALUE_OF(PERSIST, NODE) ((NODE)->data + (PERSIST)->value_offset)
+#define DATA_SIZE(PERSIST) ((PERSIST)->value_offset + (PERSIST)->value_size)
+
+/*
+ * Return the alignment needed by any type of the given size, as in rb_map.
+ */
+static size_t
+rb_persist_align(size_t size) {
+    size_t align = size & -size;
+    if (align == 0 || align > _Alignof(max_align_t)) {
+        align = _Alignof(max_align_t);
+    }
+
+    return align;
+}
+
+struct rb_persist
+rb_persist_init(size_t key_size, size_t value_size, rb_persist_cmp cmp) {
+    struct rb_persist persist;
+    persist.cmp = cmp;
+    persist.key_size = key_size;
+    persist.value_offset = ALIGN_UP(key_size, rb_persist_align(value_size));
+    persist.value_size = value_size;
+    persist.node_size = sizeof(struct rb_persist_node) + persist.value_offset + value_size;
+    persist.nodes = 0;
+    return persist;
+}
+
+struct rb_version
+rb_version_init(void) {
+    struct rb_version version;
+    version.root = NULL;
+    version.size = 0;
+    version.spare = NULL;
+    version.spares = 0;
+    return version;
+}
+
+// -----------------------------------------------------------------------------
+// Allocation and reference counting
+// -----------------------------------------------------------------------------
+
+/*
+ * Set aside enough spare nodes in a version for any single update to it, so
+ * that the update itself never allocates and so cannot fail halfway.
+ *
+ * A left-leaning red-black tree of n nodes is at most 2 log2(n + 1) high. The
+ * descent of an update is at most twice that, since each rotation on the way
+ * down revisits at most one node. At each step, an update makes modifiable at
+ * most the current node, its two children, and one grandchild, and it copies
+ * each of them at most once, since the copy then replaces it in this version.
+ */
+static bool
+rb_persist_reserve(struct rb_persist *persist, struct rb_version *version) {
+    size_t bits = 0;
+    for (size_t n = version->size + 1; n; n >>= 1) {
+        bits++;
+    }
+
+    // One more node for the leaf an insertion adds.
+    size_t needed = RB_PERSIST_COPIES * 2 * (2 * bits + 1) + 1;
+    while (version->spares < needed) {
+        struct rb_persist_node *node = malloc(persist->node_size);
+        if (!node) {
+            return false;
+        }
+
+        node->left = version->spare;
+        version->spare = node;
+        version->spares++;
+    }
+
+    return true;
+}
+
+static struct rb_persist_node *
+rb_persist_take(struct rb_persist *persist, struct rb_version *version) {
+    // Never empty, given the bound in rb_persist_reserve().
+    struct rb_persist_node *node = version->spare;
+    assert(node);
+    version->spare = node->left;
+    version->spares--;
+    __atomic_add_fetch(&persist->nodes, 1, __ATOMIC_RELAXED);
+    node->refs = 1;
+    return node;
+}
+
+static inline void
+rb_persist_retain(struct rb_persist_node *node) {
+    if (node) {
+        __atomic_add_fetch(&node->refs, 1, __ATOMIC_RELAXED);
+    }
+}
+
+/*
+ * Drop a reference to a node, freeing it and dropping its references to its
+ * children if it was the last. Only left children are recursed into, so the
+ * recursion is no deeper than the tree.
+ */
+static void
+rb_persist_release(struct rb_persist *persist, struct rb_persist_node *node) {
+    // Whoever drops the last reference must see every write made through the
+    // others, hence the acquire-release ordering.
+    while (node && __atomic_sub_fetch(&node->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+        struct rb_persist_node *right = node->right;
+        rb_persist_release(persist, node->left);
+        free(node);
+        __atomic_sub_fetch(&persist->nodes, 1, __ATOMIC_RELAXED);
+        node = right;
+    }
+}
+
+/*
+ * Return a node that can be modified in place of the given one, whose
+ * reference it takes over. A node with one reference is reachable only through
+ * the node being updated, so it is returned as is. Any other is copied, and
+ * the copy shares its children.
+ */
+static struct rb_persist_node *
+rb_persist_own(struct rb_persist *persist, struct rb_version *version, struct rb_persist_node *node) {
+    if (__atomic_load_n(&node->refs, __ATOMIC_ACQUIRE) == 1) {
+        return node;
+    }
+
+    struct rb_persist_node *copy = rb_persist_take(persist, version);
+    copy->left = node->left;
+    copy->right = node->right;
+    copy->red = node->red;
+    memcpy(copy->data, node->data, DATA_SIZE(persist));
+    rb_persist_retain(copy->left);
+    rb_persist_retain(copy->right);
+
+    // Another version may have let go of the node in the meantime, in which
+    // case it is freed here.
+    rb_persist_release(persist, node);
+    return copy;
+}
+
+struct rb_version
+rb_version_snapshot(struct rb_version *version) {
+    rb_persist_retain(version->root);
+
+    // The spare nodes stay with the version they were set aside for.
+    struct rb_version snapshot = rb_version_init();
+    snapshot.root = version->root;
+    snapshot.size = version->size;
+    return snapshot;
+}
+
+void
+rb_version_release(struct rb_persist *persist, struct rb_version *version) {
+    rb_persist_release(persist, version->root);
+    while (version->spare) {
+        struct rb_persist_node *node = version->spare;
+        version->spare = node->left;
+        free(node);
+    }
+
+    *version = rb_version_init();
+}
+
+// -----------------------------------------------------------------------------
+// Balancing
+// -----------------------------------------------------------------------------
+
+// Each of these takes a node that has already been made modifiable, and makes
+// any other node it changes modifiable first.
+
+static struct rb_persist_node *
+rb_persist_rotate_left(struct rb_persist *persist, struct rb_version *version, struct rb_persist_node *node) {
+    struct rb_persist_node *right = rb_persist_own(persist, version, node->right);
+    node->right = right->left;
+    right->left = node;
+    right->red = node->red;
+    node->red = true;
+    return right;
+}
+
+static struct rb_persist_node *
+rb_persist_rotate_right(struct rb_persist *persist, struct rb_version *version, struct rb_persist_node *node) {
+    struct rb_persist_node *left = rb_persist_own(persist, version, node->left);
+    node->left = left->right;
+    left->right = node;
+    left->red = node->red;
+    node->red = true;
+    return left;
+}
+
+static void
+rb_persist_flip(struct rb_persist *persist, struct rb_version *version, struct rb_persist_node *node) {
+    node->left = rb_persist_own(persist, version, node->left);
+    node->right = rb_persist_own(persist, version, node->right);
+    node->red = !node->red;
+    node->left->red = !node->left->red;
+    node->right->red = !node->right->red;
+}
+
+/*
+ * Restore the invariants at a node on the way back up from an update.
+ */
+static struct rb_persist_node *
+rb_persist_balance(struct rb_persist *persist, struct rb_version *version, struct rb_persist_node *node) {
+    if (IS_RED(node->right) && !IS_RED(node->left)) {
+        node = rb_persist_rotate_left(persist, version, node);
+    }
+
+    if (IS_RED(node->left) && IS_RED(node->left->left)) {
+        node = rb_persist_rotate_right(persist, version, node);
+    }
+
+    if (IS_RED(node->left) && IS_RED(node->right)) {
+        rb_persist_flip(persist, version, node);
+    }
+
+    return node;
+}
+
+/*
+ * Make the left child of a node, or one of its children, red, so that removing
+ * from the left subtree never removes a black node.
+ */
+static struct rb_persist_node *
+rb_persist_move_red_left(struct rb_persist *persist, struct rb_version *version, struct rb_persist_node *node) {
+    rb_persist_flip(persist, version, node);
+    if (IS_RED(node->right->left)) {
+        node->right = rb_persist_rotate_right(persist, version, node->right);
+        node = rb_persist_rotate_left(persist, version, node);
+        rb_persist_flip(persist, version, node);
+    }
+
+    return node;
+}
+
+/*
+ * Make the right child of a node, or one of its children, red.
+ */
+static struct rb_persist_node *
+rb_persist_move_red_right(struct rb_persist *persist, struct rb_version *version, struct rb_persist_node *node) {
+    rb_persist_flip(persist, version, node);
+    if (IS_RED(node->left->left)) {
+        node = rb_persist_rotate_right(persist, version, node);
+        rb_persist_flip(persist, version, node);
+    }
+
+    return node;
+}
+
+// -----------------------------------------------------------------------------
+// Updates
+// -----------------------------------------------------------------------------
+
+static struct rb_persist_node *
+rb_persist_insert(struct rb_persist *persist, struct rb_version *version, struct rb_persist_node *node, const void *key,
+                  const void *value, bool *added) {
+    if (!node) {
+        node = rb_persist_take(persist, version);
+        node->left = NULL;
+        node->right = NULL;
+        node->red = true;
+        memcpy(KEY_OF(node), key, persist->key_size);
+        memcpy(VALUE_OF(persist, node), value, persist->value_size);
+        *added = true;
+        return node;
+    }
+
+    node = rb_persist_own(persist, version, node);
+    int cmp = persist->cmp(key, KEY_OF(node));
+    if (cmp < 0) {
+        node->left = rb_persist_insert(persist, version, node->left, key, value, added);
+    } else if (cmp > 0) {
+        node->right = rb_persist_insert(persist, version, node->right, key, value, added);
+    } else {
+        memcpy(VALUE_OF(persist, node), value, persist->value_size);
+    }
+
+    return rb_persist_balance(persist, version, node);
+}
+
+bool
+rb_persist_put(struct rb_persist *persist, struct rb_version *version, const void *key, const void *value) {
+    if (!rb_persist_reserve(persist, version)) {
+        return false;
+    }
+
+    bool added = false;
+    struct rb_persist_node *root = rb_persist_insert(persist, version, version->root, key, value, &added);
+    root->red = false;
+    version->root = root;
+    version->size += added;
+    return true;
+}
+
+static struct rb_persist_node *
+rb_persist_delete_min(struct rb_persist *persist, struct rb_version *version, struct rb_persist_node *node) {
+    // The least node has no children, since a lone right child would be red.
+    if (!node->left) {
+        rb_persist_release(persist, node);
+        return NULL;
+    }
+
+    node = rb_persist_own(persist, version, node);
+    if (!IS_RED(node->left) && !IS_RED(node->left->left)) {
+        node = rb_persist_move_red_left(persist, version, node);
+    }
+
+    node->left = rb_persist_delete_min(persist, version, node->left);
+    return rb_persist_balance(persist, version, node);
+}
+
+/*
+ * Remove a key from the subtree rooted at `node`, and set `removed` if it was
+ * there. If it wasn't, the path to where it would be is still copied and
+ * rebalanced, but the keys and values in it are unchanged.
+ */
+static struct rb_persist_node *
+rb_persist_delete(struct rb_persist *persist, struct rb_version *version, struct rb_persist_node *node,
+                  const void *key, bool *removed) {
+    node = rb_persist_own(persist, version, node);
+    if (persist->cmp(key, KEY_OF(node)) < 0) {
+        if (!node->left) {
+            return rb_persist_balance(persist, version, node);
+        }
+
+        if (!IS_RED(node->left) && !IS_RED(node->left->left)) {
+            node = rb_persist_move_red_left(persist, version, node);
+        }
+
+        node->left = rb_persist_delete(persist, version, node->left, key, removed);
+        return rb_persist_balance(persist, version, node);
+    }
+
+    if (IS_RED(node->left)) {
+        node = rb_persist_rotate_right(persist, version, node);
+    }
+
+    if (!node->right) {
+        if (persist->cmp(key, KEY_OF(node)) == 0) {
+            *removed = true;
+            rb_persist_release(persist, node);
+            return NULL;
+        }
+
+        return rb_persist_balance(persist, version, node);
+    }
+
+    if (!IS_RED(node->right) && !IS_RED(node->right->left)) {
+        node = rb_persist_move_red_right(persist, version, node);
+    }
+
+    if (persist->cmp(key, KEY_OF(node)) == 0) {
+        // Take the place of the next node, then remove that instead.
+        struct rb_persist_node *next = node->right;
+        while (next->left) {
+            next = next->left;
+        }
+
+        *removed = true;
+        memcpy(node->data, next->data, DATA_SIZE(persist));
+        node->right = rb_persist_delete_min(persist, version, node->right);
+    } else {
+        node->right = rb_persist_delete(persist, version, node->right, key, removed);
+    }
+
+    return rb_persist_balance(persist, version, node);
+}
+
+bool
+rb_persist_del(struct rb_persist *persist, struct rb_version *version, const void *key) {
+    if (!version->root || !rb_persist_reserve(persist, version)) {
+        return false;
+    }
+
+    struct rb_persist_node *root = rb_persist_own(persist, version, version->root);
+    if (!IS_RED(root->left) && !IS_RED(root->right)) {
+        root->red = true;
+    }
+
+    bool removed = false;
+    root = rb_persist_delete(persist, version, root, key, &removed);
+    if (root) {
+        root->red = false;
+    }
+
+    version->root = root;
+    version->size -= removed;
+    return removed;
+}
+
+// -----------------------------------------------------------------------------
+// Lookup and iteration
+// -----------------------------------------------------------------------------
+
+const void *
+rb_persist_get(struct rb_persist *persist, struct rb_version *version, const void *key) {
+    struct rb_persist_node *node = version->root;
+    while (node) {
+        int cmp = persist->cmp(key, KEY_OF(node));
+        if (cmp == 0) {
+            return VALUE_OF(persist, node);
+        }
+
+        node = cmp < 0 ? node->left : node->right;
+    }
+
+    return NULL;
+}
+
+struct rb_persist_node *
+rb_persist_first(struct rb_persist_cursor *cursor, struct rb_version *version) {
+    cursor->depth = 0;
+    for (struct rb_persist_node *node = version->root; node; node = node->left) {
+        cursor->path[cursor->depth++] = node;
+    }
+
+    return cursor->depth ? cursor->path[cursor->depth - 1] : NULL;
+}
+
+struct rb_persist_node *
+rb_persist_next(struct rb_persist_cursor *cursor) {
+    if (cursor->depth == 0) {
+        return NULL;
+    }
+
+    struct rb_persist_node *node = cursor->path[cursor->depth - 1];
+    if (node->right) {
+        for (node = node->right; node; node = node->left) {
+            cursor->path[cursor->depth++] = node;
+        }
+    } else {
+        // Climb until arriving from a left child. That ancestor comes next.
+        do {
+            node = cursor->path[--cursor->depth];
+        } while (cursor->depth > 0 && cursor->path[cursor->depth - 1]->right == node);
+    }
+
+    return cursor->depth ? cursor->path[cursor->depth - 1] : NULL;
+}
+
+// -----------------------------------------------------------------------------
+// Testing
+// -----------------------------------------------------------------------------
+
+#ifndef NDEBUG
+
+static bool
+rb_persist_subtree_is_valid(struct rb_persist *persist, struct rb_persist_node *node, const void *min,
+                            const void *max, size_t *black_height, size_t *size) {
+    if (!node) {
+        *black_height = 0;
+        return true;
+    }
+
+    size_t refs = __atomic_load_n(&node->refs, __ATOMIC_RELAXED);
+    if (refs == 0 || IS_RED(node->right) || (node->red && IS_RED(node->left))) {
+        return false;
+    }
+
+    if ((min && persist->cmp(min, KEY_OF(node)) >= 0) || (max && persist->cmp(KEY_OF(node), max) >= 0)) {
+        return false;
+    }
+
+    size_t left = 0;
+    size_t right = 0;
+    if (!rb_persist_subtree_is_valid(persist, node->left, min, KEY_OF(node), &left, size) ||
+        !rb_persist_subtree_is_valid(persist, node->right, KEY_OF(node), max, &right, size) || left != right) {
+        return false;
+    }
+
+    *black_height = left + !node->red;
+    ++*size;
+    return true;
+}
+
+bool
+rb_persist_is_valid(struct rb_persist *persist, struct rb_version *version) {
+    size_t black_height = 0;
+    size_t size = 0;
+    return !IS_RED(version->root) &&
+           rb_persist_subtree_is_valid(persist, version->root, NULL, NULL, &black_height, &size) &&
+           size == version->size;
+}
+
+#endif
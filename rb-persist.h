@@ -0,0 +1,156 @@
+#ifndef RB_PERSIST_H
+#define RB_PERSIST_H
+
+#include "rb.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/*
+ * A persistent ordered map, in which taking a snapshot of a version costs O(1)
+ * and updating a version copies only the O(log n) nodes on the path it
+ * touches. Nodes are shared between versions and reference counted, and each
+ * is freed when the last version that can reach it is released.
+ *
+ * Since a node may be reachable from many versions, nodes have no parent
+ * links, and the tree is kept balanced as a left-leaning red-black tree, whose
+ * updates only ever rewrite nodes on the way back up a single descent.
+ *
+ * Keys and values have a fixed size per map and are copied into the nodes, as
+ * in rb_map. A version must only be updated by one thread at a time, and only
+ * that thread may snapshot it, but snapshots can then be handed to, read by,
+ * and released from any thread. Different versions of the same map can be
+ * updated by different threads at once.
+ */
+
+/*
+ * Compare two keys, like the comparison function passed to qsort().
+ */
+typedef int (*rb_persist_cmp)(const void *left, const void *right);
+
+struct rb_persist_node {
+    struct rb_persist_node *left;
+    struct rb_persist_node *right;
+    size_t refs;
+    bool red;
+    _Alignas(max_align_t) unsigned char data[];
+};
+
+/*
+ * The layout of the nodes of a map, shared by all of its versions.
+ */
+struct rb_persist {
+    rb_persist_cmp cmp;
+    size_t key_size;
+    size_t value_offset;
+    size_t value_size;
+    size_t node_size;
+    size_t nodes; // The number of nodes alive across every version.
+};
+
+/*
+ * A version of a map, which holds a reference to its root. A version that is
+ * updated also keeps a few spare nodes aside, so that no update can fail
+ * halfway. Versions must only be copied with rb_version_snapshot().
+ */
+struct rb_version {
+    struct rb_persist_node *root;
+    size_t size;
+    struct rb_persist_node *spare;
+    size_t spares;
+};
+
+/*
+ * A position in a version, kept as the path from the root down to the current
+ * node.
+ */
+struct rb_persist_cursor {
+    size_t depth;
+    struct rb_persist_node *path[RB_MAX_HEIGHT];
+};
+
+/*
+ * Return a new map with keys and values of the given sizes.
+ */
+struct rb_persist rb_persist_init(size_t key_size, size_t value_size, rb_persist_cmp cmp);
+
+/*
+ * Return a new, empty version.
+ */
+struct rb_version rb_version_init(void);
+
+/*
+ * Return a snapshot of a version, which stays the same whatever happens to
+ * the version afterwards, in O(1). It must be released when no longer needed.
+ */
+struct rb_version rb_version_snapshot(struct rb_version *version);
+
+/*
+ * Release a version, freeing every node that no other version can reach, along
+ * with its spare nodes.
+ */
+void rb_version_release(struct rb_persist *persist, struct rb_version *version);
+
+/*
+ * Set the value of a key in a version, adding the key if it isn't there
+ * already. Return false, leaving the version unchanged, if memory could not be
+ * allocated.
+ */
+bool rb_persist_put(struct rb_persist *persist, struct rb_version *version, const void *key, const void *value);
+
+/*
+ * Return a pointer to the value of a key in a version, or NULL if it isn't
+ * there. The value must not be modified.
+ */
+const void *rb_persist_get(struct rb_persist *persist, struct rb_version *version, const void *key);
+
+/*
+ * Remove a key from a version. Return true if it was there, else false. Return
+ * false, leaving the version unchanged, if memory could not be allocated.
+ */
+bool rb_persist_del(struct rb_persist *persist, struct rb_version *version, const void *key);
+
+/*
+ * Move a cursor to the node with the least key in a version, and return it, or
+ * return NULL if the version is empty.
+ */
+struct rb_persist_node *rb_persist_first(struct rb_persist_cursor *cursor, struct rb_version *version);
+
+/*
+ * Move a cursor to the next node in key order, and return it, or return NULL
+ * if there is none.
+ */
+struct rb_persist_node *rb_persist_next(struct rb_persist_cursor *cursor);
+
+/*
+ * Return a pointer to the key of a node.
+ */
+static inline const void *
+rb_persist_key(struct rb_persist *persist, struct rb_persist_node *node) {
+    (void) persist;
+    return node->data;
+}
+
+/*
+ * Return a pointer to the value of a node.
+ */
+static inline const void *
+rb_persist_value(struct rb_persist *persist, struct rb_persist_node *node) {
+    return node->data + persist->value_offset;
+}
+
+/*
+ * The functions below are only needed for testing.
+ */
+#ifndef NDEBUG
+
+/*
+ * Return true if a version is a valid left-leaning red-black tree: its keys
+ * are in order, no red node has a red child, only left children are red, and
+ * every path from the root down to a leaf has the same number of black nodes.
+ */
+bool rb_persist_is_valid(struct rb_persist *persist, struct rb_version *version);
+
+#endif
+
+#endif
@@ -0,0 +1,299 @@
+#include "rb-shard.h"
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdlib.h>
+
+#define SIZE_OF(TREE) ((TREE)->root ? rb_entry((TREE)->root, struct rb_sized_node, rb_node)->size : 0)
+
+bool
+rb_shard_map_init(struct rb_shard_map *map, rb_cmp cmp, rb_shard_copy copy, struct rb_node **bounds,
+                  size_t nshards) {
+    if (nshards == 0) {
+        return false;
+    }
+
+    // Each shard is on its own cache lines, so that locking one doesn't slow
+    // down its neighbours. Its size is a multiple of its alignment, as
+    // aligned_alloc() requires.
+    map->shards = aligned_alloc(_Alignof(struct rb_shard), nshards * sizeof(struct rb_shard));
+    map->bounds = malloc(nshards * sizeof(struct rb_node *));
+    if (!map->shards || !map->bounds || pthread_rwlock_init(&map->lock, NULL) != 0) {
+        free(map->shards);
+        free(map->bounds);
+        return false;
+    }
+
+    map->cmp = cmp;
+    map->copy = copy;
+    map->nshards = nshards;
+
+    for (size_t i = 0; i < nshards; i += 1) {
+        if (pthread_mutex_init(&map->shards[i].lock, NULL) != 0) {
+            while (i > 0) {
+                i -= 1;
+                pthread_mutex_destroy(&map->shards[i].lock);
+            }
+
+            pthread_rwlock_destroy(&map->lock);
+            free(map->shards);
+            free(map->bounds);
+            return false;
+        }
+
+        map->shards[i].tree = rb_tree_init_sized(cmp);
+    }
+
+    for (size_t i = 0; i + 1 < nshards; i += 1) {
+        map->bounds[i] = bounds[i];
+    }
+
+    return true;
+}
+
+void
+rb_shard_map_destroy(struct rb_shard_map *map) {
+    for (size_t i = 0; i < map->nshards; i += 1) {
+        pthread_mutex_destroy(&map->shards[i].lock);
+    }
+
+    pthread_rwlock_destroy(&map->lock);
+    free(map->shards);
+    free(map->bounds);
+}
+
+/*
+ * Return the shard whose range holds the key, which is the number of
+ * boundaries that are less than or equal to it.
+ */
+static struct rb_shard *
+rb_shard_of(struct rb_shard_map *map, struct rb_node *key) {
+    size_t low = 0;
+    size_t high = map->nshards - 1;
+    while (low < high) {
+        size_t mid = low + (high - low) / 2;
+        if (map->cmp(map->bounds[mid], key) <= 0) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+
+    return &map->shards[low];
+}
+
+bool
+rb_shard_insert(struct rb_shard_map *map, struct rb_node *node) {
+    pthread_rwlock_rdlock(&map->lock);
+    struct rb_shard *shard = rb_shard_of(map, node);
+
+    pthread_mutex_lock(&shard->lock);
+    bool inserted = rb_insert(&shard->tree, node);
+    pthread_mutex_unlock(&shard->lock);
+
+    pthread_rwlock_unlock(&map->lock);
+    return inserted;
+}
+
+struct rb_node *
+rb_shard_search(struct rb_shard_map *map, struct rb_node *key) {
+    pthread_rwlock_rdlock(&map->lock);
+    struct rb_shard *shard = rb_shard_of(map, key);
+
+    pthread_mutex_lock(&shard->lock);
+    struct rb_node *found = rb_search(&shard->tree, key);
+    pthread_mutex_unlock(&shard->lock);
+
+    pthread_rwlock_unlock(&map->lock);
+    return found;
+}
+
+struct rb_node *
+rb_shard_remove(struct rb_shard_map *map, struct rb_node *key) {
+    pthread_rwlock_rdlock(&map->lock);
+    struct rb_shard *shard = rb_shard_of(map, key);
+
+    pthread_mutex_lock(&shard->lock);
+    struct rb_node *found = rb_search(&shard->tree, key);
+    if (found) {
+        rb_erase(&shard->tree, found);
+    }
+    pthread_mutex_unlock(&shard->lock);
+
+    pthread_rwlock_unlock(&map->lock);
+    return found;
+}
+
+size_t
+rb_shard_size(struct rb_shard_map *map) {
+    size_t size = 0;
+
+    pthread_rwlock_rdlock(&map->lock);
+    for (size_t i = 0; i < map->nshards; i += 1) {
+        pthread_mutex_lock(&map->shards[i].lock);
+        size += SIZE_OF(&map->shards[i].tree);
+        pthread_mutex_unlock(&map->shards[i].lock);
+    }
+    pthread_rwlock_unlock(&map->lock);
+
+    return size;
+}
+
+// -----------------------------------------------------------------------------
+// Iteration
+// -----------------------------------------------------------------------------
+
+/*
+ * Return the least node in the shards from `shard` onwards, or NULL if they
+ * are all empty. The map lock must be held.
+ */
+static struct rb_node *
+rb_shard_first_from(struct rb_shard_map *map, struct rb_shard *shard) {
+    for (; shard < map->shards + map->nshards; shard += 1) {
+        pthread_mutex_lock(&shard->lock);
+        struct rb_node *first = shard->tree.first;
+        pthread_mutex_unlock(&shard->lock);
+
+        if (first) {
+            return first;
+        }
+    }
+
+    return NULL;
+}
+
+struct rb_node *
+rb_shard_first(struct rb_shard_map *map) {
+    pthread_rwlock_rdlock(&map->lock);
+    struct rb_node *first = rb_shard_first_from(map, map->shards);
+    pthread_rwlock_unlock(&map->lock);
+    return first;
+}
+
+struct rb_node *
+rb_shard_next(struct rb_shard_map *map, struct rb_node *node) {
+    pthread_rwlock_rdlock(&map->lock);
+    struct rb_shard *shard = rb_shard_of(map, node);
+
+    pthread_mutex_lock(&shard->lock);
+    struct rb_node *next = rb_next(node);
+    pthread_mutex_unlock(&shard->lock);
+
+    if (!next) {
+        next = rb_shard_first_from(map, shard + 1);
+    }
+
+    pthread_rwlock_unlock(&map->lock);
+    return next;
+}
+
+// -----------------------------------------------------------------------------
+// Rebalancing
+// -----------------------------------------------------------------------------
+
+/*
+ * Move all but the first `keep` nodes of shard i to the front of shard i + 1,
+ * and move the boundary between them down to the first node moved.
+ */
+static void
+rb_shard_push(struct rb_shard_map *map, size_t i, size_t keep) {
+    struct rb_tree *tree = &map->shards[i].tree;
+    struct rb_tree *next = &map->shards[i + 1].tree;
+
+    struct rb_tree low;
+    struct rb_tree high;
+    rb_split(tree, rb_select(tree, keep), &low, &high);
+    *tree = low;
+
+    map->copy(map->bounds[i], high.first);
+
+    struct rb_node *pivot = rb_pop_last(&high);
+    rb_join(&high, pivot, next);
+#ifdef RB_STATS
+    // Each shard keeps its own stats, which the split left with `low`.
+    rb_stats_add(&high.stats, &next->stats);
+#endif
+    *next = high;
+}
+
+/*
+ * Move the first `count` nodes of shard j, which must have at least that many,
+ * to the end of shard i, where i < j and every shard in between is empty.
+ */
+static void
+rb_shard_pull(struct rb_shard_map *map, size_t i, size_t j, size_t count) {
+    struct rb_tree *tree = &map->shards[i].tree;
+    struct rb_tree *from = &map->shards[j].tree;
+
+    struct rb_tree low;
+    struct rb_tree high;
+    if (count < SIZE_OF(from)) {
+        rb_split(from, rb_select(from, count), &low, &high);
+        *from = high;
+    } else {
+        low = *from;
+        *from = rb_tree_init_sized(map->cmp);
+    }
+
+    struct rb_node *pivot = rb_pop_first(&low);
+    rb_join(tree, pivot, &low);
+#ifdef RB_STATS
+    // Shard j keeps its stats, along with those of moving the nodes out.
+    rb_stats_add(&from->stats, &low.stats);
+#endif
+}
+
+void
+rb_shard_rebalance(struct rb_shard_map *map) {
+    pthread_rwlock_wrlock(&map->lock);
+
+    size_t total = 0;
+    for (size_t i = 0; i < map->nshards; i += 1) {
+        total += SIZE_OF(&map->shards[i].tree);
+    }
+
+    // Fix each boundary in turn, from the left, so that every shard before it
+    // holds its share. Any remainder goes to the last shards, so the last one
+    // is never empty unless the whole map is, and there is always a node
+    // after a boundary to move it to.
+    size_t share = total / map->nshards;
+    size_t extra = total % map->nshards;
+
+    for (size_t i = 0; i + 1 < map->nshards; i += 1) {
+        size_t target = share + (i >= map->nshards - extra);
+        size_t size = SIZE_OF(&map->shards[i].tree);
+
+        if (size > target) {
+            rb_shard_push(map, i, target);
+        } else if (size < target) {
+            // Take nodes from the following shards, emptying any that are too
+            // small on the way.
+            size_t j = i + 1;
+            for (size_t missing = target - size; missing > 0; j += 1) {
+                size_t count = SIZE_OF(&map->shards[j].tree);
+                if (count > missing) {
+                    count = missing;
+                }
+
+                if (count > 0) {
+                    rb_shard_pull(map, i, j, count);
+                }
+
+                missing -= count;
+            }
+
+            // The shards in between are now empty, and start and end at the
+            // first node that is left.
+            struct rb_node *first = NULL;
+            for (j = i + 1; !first; j += 1) {
+                first = map->shards[j].tree.first;
+            }
+
+            for (size_t k = i; k + 1 < j; k += 1) {
+                map->copy(map->bounds[k], first);
+            }
+        }
+    }
+
+    pthread_rwlock_unlock(&map->lock);
+}
@@ -0,0 +1,100 @@
+#ifndef RB_SHARD_H
+#define RB_SHARD_H
+
+#include "rb.h"
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+/*
+ * A concurrent ordered map that partitions the key space into shards, each an
+ * order-statistic tree behind its own lock, so that updates to different
+ * shards run in parallel.
+ *
+ * Shard i holds the keys in [bounds[i - 1], bounds[i]), where the first and
+ * last shards are unbounded below and above. The boundaries are nodes owned by
+ * the caller, and only ever hold keys: when shards are rebalanced, keys are
+ * copied into them with the given callback.
+ *
+ * Elements embed a struct rb_sized_node, and functions take a pointer to the
+ * struct rb_node inside it, as with rb_tree_init_sized().
+ */
+
+/*
+ * Copy the key of `src` into `dst`, which is one of the boundaries.
+ */
+typedef void (*rb_shard_copy)(struct rb_node *dst, struct rb_node *src);
+
+struct rb_shard {
+    pthread_mutex_t lock;
+    struct rb_tree tree;
+} __attribute__((aligned(64)));
+
+struct rb_shard_map {
+    // Held for reading by every operation, and for writing while rebalancing.
+    pthread_rwlock_t lock;
+    rb_cmp cmp;
+    rb_shard_copy copy;
+    size_t nshards;
+    struct rb_shard *shards;
+    struct rb_node **bounds;
+};
+
+/*
+ * Initialize a map with nshards shards, at least one, split by the nshards - 1
+ * boundaries in `bounds`, whose keys must be in increasing order. The
+ * boundaries must outlive the map. Return false if nshards is zero, or if
+ * memory or locks could not be allocated.
+ */
+bool rb_shard_map_init(struct rb_shard_map *map, rb_cmp cmp, rb_shard_copy copy, struct rb_node **bounds,
+                       size_t nshards);
+
+/*
+ * Free the memory used by a map. The elements are left as they are.
+ */
+void rb_shard_map_destroy(struct rb_shard_map *map);
+
+/*
+ * Insert a node into the map. If an equal node is already in the map, then
+ * return false and leave the map unchanged, else return true.
+ */
+bool rb_shard_insert(struct rb_shard_map *map, struct rb_node *node);
+
+/*
+ * If a node equal to the key is in the map, then return it, else return NULL.
+ */
+struct rb_node *rb_shard_search(struct rb_shard_map *map, struct rb_node *key);
+
+/*
+ * If a node equal to the key is in the map, then remove it and return it, else
+ * return NULL.
+ */
+struct rb_node *rb_shard_remove(struct rb_shard_map *map, struct rb_node *key);
+
+/*
+ * Return the number of nodes in the map.
+ */
+size_t rb_shard_size(struct rb_shard_map *map);
+
+/*
+ * Return the node with the least key in the map, or NULL if the map is empty.
+ */
+struct rb_node *rb_shard_first(struct rb_shard_map *map);
+
+/*
+ * Return the node after the given one in key order, across shards, or NULL if
+ * it is the last. The given node must stay in the map until this returns.
+ * Nodes inserted or removed during an iteration may or may not be visited.
+ */
+struct rb_node *rb_shard_next(struct rb_shard_map *map, struct rb_node *node);
+
+/*
+ * Move boundaries so that every shard holds the same number of nodes, give or
+ * take one. Nodes are moved between shards by splitting and joining their
+ * trees, so this takes O(nshards log n), during which every other operation on
+ * the map waits. Call it when rb_shard_size() and the shard sizes show skew.
+ */
+void rb_shard_rebalance(struct rb_shard_map *map);
+
+#endif
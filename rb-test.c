@@ -1,10 +1,21 @@
 #include "rb.h"
+#include "rb-image.h"
+#include "rb-interval.h"
+#include "rb-latch.h"
+#include "rb-map.h"
+#include "rb-persist.h"
+#include "rb-shard.h"
+#include "rb-u64.h"
+#include "rb32.h"
 
 #include <assert.h>
+#include <pthread.h>
 #include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <time.h>
+#include <unistd.h>
 
 #define TESTS 1000000
 
@@ -29,6 +40,115 @@ cmp(struct rb_node *l, struct rb_node *r) {
     return 0;
 }
 
+struct sized_box {
+    int key;
+    struct rb_sized_node rb_node;
+};
+
+int
+sized_cmp(struct rb_node *l, struct rb_node *r) {
+    struct sized_box *lb = rb_entry(l, struct sized_box, rb_node.rb_node);
+    struct sized_box *rb = rb_entry(r, struct sized_box, rb_node.rb_node);
+
+    if (lb->key < rb->key)
+        return -1;
+    if (lb->key > rb->key)
+        return +1;
+    return 0;
+}
+
+struct max_box {
+    int key;
+    int max; // The greatest key in the subtree.
+    struct rb_node rb_node;
+};
+
+int
+max_cmp(struct rb_node *l, struct rb_node *r) {
+    struct max_box *lb = rb_entry(l, struct max_box, rb_node);
+    struct max_box *rb = rb_entry(r, struct max_box, rb_node);
+
+    if (lb->key < rb->key)
+        return -1;
+    if (lb->key > rb->key)
+        return +1;
+    return 0;
+}
+
+static inline int
+max_compute(struct max_box *box) {
+    int max = box->key;
+    if (box->rb_node.left && rb_entry(box->rb_node.left, struct max_box, rb_node)->max > max)
+        max = rb_entry(box->rb_node.left, struct max_box, rb_node)->max;
+    if (box->rb_node.right && rb_entry(box->rb_node.right, struct max_box, rb_node)->max > max)
+        max = rb_entry(box->rb_node.right, struct max_box, rb_node)->max;
+    return max;
+}
+
+RB_DECLARE_AUGMENT(max_augment, struct max_box, rb_node, max, max_compute);
+
+static inline int
+box_cmp(struct box *l, struct box *r) {
+    return (l->key > r->key) - (l->key < r->key);
+}
+
+RB_GENERATE(box_tree, struct box, rb_node, box_cmp)
+
+struct box32 {
+    int key;
+    struct rb32_node rb_node;
+};
+
+int
+box32_cmp(const void *l, const void *r) {
+    const struct box32 *lb = l;
+    const struct box32 *rb = r;
+    return (lb->key > rb->key) - (lb->key < rb->key);
+}
+
+int
+int_cmp(const void *l, const void *r) {
+    int a = *(const int *) l;
+    int b = *(const int *) r;
+    return (a > b) - (a < b);
+}
+
+static void
+box_encode(struct rb_node *node, void *data, size_t size) {
+    assert(size == sizeof(int));
+    memcpy(data, &rb_entry(node, struct box, rb_node)->key, size);
+}
+
+static int
+box_image_cmp(const void *key, const void *data) {
+    int a = *(const int *) key;
+    int b = *(const int *) data;
+    return (a > b) - (a < b);
+}
+
+struct latch_box {
+    int key;
+    struct rb_latch_node rb_node;
+};
+
+int
+latch_cmp(struct rb_latch_node *l, struct rb_latch_node *r) {
+    struct latch_box *lb = rb_entry(l, struct latch_box, rb_node);
+    struct latch_box *rb = rb_entry(r, struct latch_box, rb_node);
+    return (lb->key > rb->key) - (lb->key < rb->key);
+}
+
+// Comparisons for checking each copy of a latch tree with rb_is_valid().
+int
+latch_cmp_0(struct rb_node *l, struct rb_node *r) {
+    return latch_cmp(rb_entry(l, struct rb_latch_node, rb_node[0]), rb_entry(r, struct rb_latch_node, rb_node[0]));
+}
+
+int
+latch_cmp_1(struct rb_node *l, struct rb_node *r) {
+    return latch_cmp(rb_entry(l, struct rb_latch_node, rb_node[1]), rb_entry(r, struct rb_latch_node, rb_node[1]));
+}
+
 // ----------------------------------------------------------------------------
 // Tests
 // ----------------------------------------------------------------------------
@@ -93,6 +213,112 @@ test_insert_random(void) {
     free(boxes);
 }
 
+/*
+ * Test lookup-or-insert of TESTS random elements, using the split insertion
+ * API. Duplicate keys are found instead of being linked.
+ *
+ * This test does not rely on any other test and can be assumed to be a measure
+ * of correctness for insertion.
+ */
+void
+test_insert_split(void) {
+    struct rb_tree tree = rb_tree_init(cmp);
+
+    struct box *boxes = malloc(TESTS * sizeof(struct box));
+    assert(boxes);
+
+    for (ptrdiff_t i = 0; i < TESTS; i += 1) {
+        boxes[i].key = rand() % (TESTS / 2);
+        boxes[i].rb_node = rb_node_init();
+
+        struct rb_node *parent = NULL;
+        struct rb_node **link = NULL;
+        struct rb_node *found = rb_find_slot(&tree, &boxes[i].rb_node, &parent, &link);
+        if (found) {
+            assert(rb_entry(found, struct box, rb_node)->key == boxes[i].key);
+            assert(!rb_is_linked(&boxes[i].rb_node));
+        } else {
+            rb_link_node(&boxes[i].rb_node, parent, link);
+            rb_insert_color(&tree, &boxes[i].rb_node);
+            assert(rb_search(&tree, &boxes[i].rb_node) == &boxes[i].rb_node);
+        }
+    }
+
+    assert(rb_is_valid(&tree));
+    free(boxes);
+}
+
+/*
+ * Test bulk construction from sorted arrays of every size up to 1000, and of
+ * TESTS elements, followed by insertion and removal on the built tree.
+ *
+ * This test assumes the insertion, search, and removal operations are correct
+ * and should not be used as the sole measure of correctness.
+ */
+void
+test_build_sorted(void) {
+    struct box *boxes = malloc(TESTS * sizeof(struct box));
+    struct rb_node **nodes = malloc(TESTS * sizeof(struct rb_node *));
+    assert(boxes && nodes);
+
+    for (ptrdiff_t i = 0; i < TESTS; i += 1) {
+        boxes[i].key = 2 * i;
+        boxes[i].rb_node = rb_node_init();
+        nodes[i] = &boxes[i].rb_node;
+    }
+
+    for (ptrdiff_t n = 0; n <= 1000; n += 1) {
+        struct rb_tree tree = rb_tree_init(cmp);
+        rb_build_sorted(&tree, nodes, n);
+        assert(rb_is_valid(&tree));
+    }
+
+    struct rb_tree tree = rb_tree_init(cmp);
+    rb_build_sorted(&tree, nodes, TESTS);
+    assert(rb_is_valid(&tree));
+
+    for (ptrdiff_t i = 0; i < TESTS; i += 1) {
+        assert(rb_search(&tree, &boxes[i].rb_node) == &boxes[i].rb_node);
+    }
+
+    // The built tree must behave like any other. Odd keys fill the gaps.
+    struct box *extra = malloc(TESTS * sizeof(struct box));
+    assert(extra);
+
+    for (ptrdiff_t i = 0; i < TESTS; i += 1) {
+        extra[i].key = 2 * i + 1;
+        extra[i].rb_node = rb_node_init();
+        struct rb_node *inserted = rb_insert(&tree, &extra[i].rb_node);
+        assert(inserted);
+        rb_erase(&tree, &boxes[i].rb_node);
+    }
+
+    assert(rb_is_valid(&tree));
+
+    // Order statistics must be available straight after building.
+    struct sized_box *sized = malloc(TESTS * sizeof(struct sized_box));
+    assert(sized);
+
+    for (ptrdiff_t i = 0; i < TESTS; i += 1) {
+        sized[i].key = i;
+        sized[i].rb_node.rb_node = rb_node_init();
+        nodes[i] = &sized[i].rb_node.rb_node;
+    }
+
+    tree = rb_tree_init_sized(sized_cmp);
+    rb_build_sorted(&tree, nodes, TESTS);
+    assert(rb_is_valid(&tree));
+
+    for (ptrdiff_t i = 0; i < TESTS; i += 1) {
+        assert(rb_select(&tree, i) == nodes[i]);
+    }
+
+    free(sized);
+    free(extra);
+    free(nodes);
+    free(boxes);
+}
+
 /*
  * Both search tests follow the following pattern:
  *
@@ -195,6 +421,251 @@ test_search_random(void) {
     free(boxes);
 }
 
+/*
+ * Test batched searches over the even keys in [0, 2 * TESTS), probing in a
+ * random order with both even and odd keys, in batches of various sizes.
+ *
+ * This test assumes the insertion operation is correct and should not be used
+ * as the sole measure of correctness.
+ */
+void
+test_search_batch(void) {
+    struct rb_tree tree = rb_tree_init(cmp);
+
+    struct box *boxes = malloc(TESTS * sizeof(struct box));
+    struct box *probes = malloc(TESTS * sizeof(struct box));
+    struct rb_node **keys = malloc(TESTS * sizeof(struct rb_node *));
+    struct rb_node **out = malloc(TESTS * sizeof(struct rb_node *));
+    assert(boxes && probes && keys && out);
+
+    // Searching an empty tree finds nothing.
+    probes[0].key = 0;
+    keys[0] = &probes[0].rb_node;
+    out[0] = keys[0];
+    rb_search_batch(&tree, keys, 1, out);
+    assert(!out[0]);
+
+    for (ptrdiff_t i = 0; i < TESTS; i += 1) {
+        boxes[i].key = 2 * i;
+        boxes[i].rb_node = rb_node_init();
+        rb_insert(&tree, &boxes[i].rb_node);
+    }
+
+    for (ptrdiff_t i = 0; i < TESTS; i += 1) {
+        probes[i].key = rand() % (2 * TESTS);
+        keys[i] = &probes[i].rb_node;
+    }
+
+    size_t sizes[] = {0, 1, RB_BATCH - 1, RB_BATCH + 1, TESTS};
+    for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s += 1) {
+        rb_search_batch(&tree, keys, sizes[s], out);
+
+        for (size_t i = 0; i < sizes[s]; i += 1) {
+            int key = probes[i].key;
+            assert(out[i] == (key % 2 == 0 ? &boxes[key / 2].rb_node : NULL));
+        }
+    }
+
+    free(out);
+    free(keys);
+    free(probes);
+    free(boxes);
+}
+
+/*
+ * Test cursors over the even keys in [0, 2 * TESTS), checking full scans in
+ * both directions against rb_next() and rb_prev(), and stepping both ways
+ * from seeks to both even and odd keys.
+ *
+ * This test assumes the insertion and iteration operations are correct and
+ * should not be used as the sole measure of correctness.
+ */
+void
+test_cursor(void) {
+    struct rb_tree tree = rb_tree_init(cmp);
+    struct rb_cursor cursor;
+    struct rb_node *node = NULL;
+
+    rb_cursor_for_each(&cursor, &tree, node) {
+        assert(false);
+    }
+
+    struct box *boxes = malloc(TESTS * sizeof(struct box));
+    assert(boxes);
+
+    for (ptrdiff_t i = 0; i < TESTS; i += 1) {
+        boxes[i].key = 2 * i;
+        boxes[i].rb_node = rb_node_init();
+    }
+
+    // Insert in a scrambled order, so that the shape of the tree is irregular.
+    // Since 7919 is prime, every index is visited once.
+    for (ptrdiff_t i = 0; i < TESTS; i += 1) {
+        rb_insert(&tree, &boxes[i * 7919 % TESTS].rb_node);
+    }
+
+    ptrdiff_t i = 0;
+    rb_cursor_for_each(&cursor, &tree, node) {
+        assert(node == &boxes[i].rb_node);
+        i += 1;
+    }
+    assert(i == TESTS);
+
+    rb_cursor_for_each_reverse(&cursor, &tree, node) {
+        i -= 1;
+        assert(node == &boxes[i].rb_node && rb_prev(node) == (i ? &boxes[i - 1].rb_node : NULL));
+    }
+    assert(i == 0);
+
+    for (ptrdiff_t j = 0; j < 1000; j += 1) {
+        struct box key;
+        key.key = rand() % (2 * TESTS + 1);
+        ptrdiff_t bound = (key.key + 1) / 2;
+
+        node = rb_cursor_seek(&cursor, &tree, &key.rb_node);
+        if (bound == TESTS) {
+            assert(!node);
+            continue;
+        }
+
+        assert(node == &boxes[bound].rb_node && rb_cursor_get(&cursor) == node);
+
+        // Step forwards, then back past the starting point.
+        for (ptrdiff_t k = bound + 1; k < bound + 5 && k < TESTS; k += 1) {
+            node = rb_cursor_next(&cursor);
+            assert(node == &boxes[k].rb_node);
+        }
+
+        rb_cursor_seek(&cursor, &tree, &key.rb_node);
+        for (ptrdiff_t k = bound - 1; k > bound - 5; k -= 1) {
+            node = rb_cursor_prev(&cursor);
+            assert(node == (k >= 0 ? &boxes[k].rb_node : NULL));
+            if (k < 0) {
+                break;
+            }
+        }
+    }
+
+    free(boxes);
+}
+
+#ifdef RB_STATS
+
+/*
+ * Test the stats counted with RB_STATS, over TESTS sequential insertions and
+ * then removals, which exercise every rebalancing case.
+ */
+void
+test_stats(void) {
+    struct rb_tree tree = rb_tree_init(cmp);
+
+    struct box *boxes = malloc(TESTS * sizeof(struct box));
+    assert(boxes);
+
+    for (ptrdiff_t i = 0; i < TESTS; i += 1) {
+        boxes[i].key = i;
+        boxes[i].rb_node = rb_node_init();
+        rb_insert(&tree, &boxes[i].rb_node);
+    }
+
+    // Ascending keys always land on the outside, on the right.
+    struct rb_stats *stats = &tree.stats;
+    assert(stats->comparisons >= TESTS - 1);
+    assert(stats->rotations[0] > 0 && stats->rotations[1] == 0);
+    assert(stats->insert_cases[0] > 0 && stats->insert_cases[1] == 0 && stats->insert_cases[2] > 0);
+    assert(stats->max_depth > 0 && stats->max_depth <= 2 * 20);
+
+    // A split hands the tree's stats, and its own comparisons, to the low half.
+    uint64_t comparisons = stats->comparisons;
+    struct rb_tree low;
+    struct rb_tree high;
+    rb_split(&tree, &boxes[TESTS / 2].rb_node, &low, &high);
+    assert(low.stats.comparisons > comparisons && high.stats.comparisons == 0);
+
+    struct rb_node *pivot = rb_pop_first(&high);
+    rb_join(&low, pivot, &high);
+    tree = low;
+
+    for (ptrdiff_t i = 0; i < TESTS; i += 1) {
+        struct rb_node *removed = rb_remove(&tree, &boxes[(i * 7919) % TESTS].rb_node);
+        assert(removed);
+    }
+
+    for (ptrdiff_t i = 0; i < 4; i += 1) {
+        assert(stats->remove_cases[i] > 0);
+    }
+
+    struct rb_stats total = {0};
+    rb_stats_add(&total, stats);
+    rb_stats_add(&total, stats);
+    assert(total.comparisons == 2 * stats->comparisons && total.max_depth == stats->max_depth);
+
+    free(boxes);
+}
+
+#endif
+
+/*
+ * Test bound searches and range iteration over the even keys in [0, 2 * TESTS),
+ * probing with both even keys, which are in the tree, and odd keys, which
+ * aren't.
+ *
+ * This test assumes the insertion operation is correct and should not be used
+ * as the sole measure of correctness.
+ */
+void
+test_search_bounds(void) {
+    struct rb_tree tree = rb_tree_init(cmp);
+
+    struct box *boxes = malloc(TESTS * sizeof(struct box));
+    assert(boxes);
+
+    for (ptrdiff_t i = 0; i < TESTS; i += 1) {
+        boxes[i].key = 2 * i;
+        boxes[i].rb_node = rb_node_init();
+        rb_insert(&tree, &boxes[i].rb_node);
+    }
+
+#define KEY_OF(NODE) ((NODE) ? rb_entry(NODE, struct box, rb_node)->key : -1)
+
+    for (int key = -1; key <= 2 * TESTS; key += 1) {
+        struct box box;
+        box.key = key;
+
+        int even_above = key < 0 ? 0 : key + key % 2;
+        int even_below = key % 2 == 0 ? key : key - 1;
+        int lower = even_above < 2 * TESTS ? even_above : -1;
+        int upper = key % 2 == 0 ? (key + 2 < 2 * TESTS ? key + 2 : -1) : lower;
+        int floor = even_below >= 0 && even_below < 2 * TESTS ? even_below : (key < 0 ? -1 : 2 * TESTS - 2);
+
+        assert(KEY_OF(rb_lower_bound(&tree, &box.rb_node)) == lower);
+        assert(KEY_OF(rb_ceil(&tree, &box.rb_node)) == lower);
+        assert(KEY_OF(rb_upper_bound(&tree, &box.rb_node)) == upper);
+        assert(KEY_OF(rb_floor(&tree, &box.rb_node)) == floor);
+    }
+
+#undef KEY_OF
+
+    // Iterate over random ranges. Odd bounds aren't in the tree.
+    for (ptrdiff_t i = 0; i < 1000; i += 1) {
+        struct box low;
+        struct box high;
+        low.key = rand() % (2 * TESTS);
+        high.key = low.key + rand() % 1000;
+
+        int expected = low.key + low.key % 2;
+        struct rb_node *node = NULL;
+        rb_for_each_range(tree, node, &low.rb_node, &high.rb_node) {
+            assert(rb_entry(node, struct box, rb_node)->key == expected);
+            expected += 2;
+        }
+
+        assert(expected >= high.key || expected >= 2 * TESTS);
+    }
+
+    free(boxes);
+}
+
 /*
  * Test insertion of in-order elements, in [0, TESTS).
  *
@@ -285,6 +756,59 @@ test_remove_random(void) {
     free(boxes);
 }
 
+/*
+ * Test erasure of TESTS random elements, half of which are erased.
+ *
+ * This test assumes the insertion and search operations are correct and should
+ * not be used as the sole measure of correctness.
+ */
+void
+test_erase_random(void) {
+    struct rb_tree tree = rb_tree_init(cmp);
+
+    struct box *boxes = malloc(TESTS * sizeof(struct box));
+    assert(boxes);
+
+    // Build up the tree.
+    for (ptrdiff_t i = 0; i < TESTS; i += 1) {
+        boxes[i].rb_node = rb_node_init();
+        assert(!rb_is_linked(&boxes[i].rb_node));
+
+        // Generate a key until it isn't a duplicate.
+        do {
+            boxes[i].key = rand();
+        } while (!rb_insert(&tree, &boxes[i].rb_node));
+
+        assert(rb_is_linked(&boxes[i].rb_node));
+    }
+
+    // Erase every other item from the tree.
+    for (ptrdiff_t i = 0; i < TESTS; i += 2) {
+        rb_erase(&tree, &boxes[i].rb_node);
+        assert(!rb_is_linked(&boxes[i].rb_node));
+    }
+
+    assert(rb_is_valid(&tree));
+
+    // Only the items that weren't erased should still be found.
+    for (ptrdiff_t i = 0; i < TESTS; i += 1) {
+        struct rb_node *found = rb_search(&tree, &boxes[i].rb_node);
+        assert(i % 2 == 0 ? !found : found == &boxes[i].rb_node);
+        assert(rb_is_linked(&boxes[i].rb_node) == (i % 2 != 0));
+    }
+
+    // Removing an unlinked node should fail, even when an equal node is linked.
+    struct box box;
+    box.key = boxes[1].key;
+    box.rb_node = rb_node_init();
+    struct rb_node *removed = rb_remove(&tree, &box.rb_node);
+    assert(!removed);
+    removed = rb_remove(&tree, &boxes[0].rb_node);
+    assert(!removed);
+
+    free(boxes);
+}
+
 /*
  * Test insertion, search, and removal on the same tree. Elements are inserted in-order.
  */
@@ -424,10 +948,1238 @@ test_all_random(void) {
     free(boxes);
 }
 
-// ----------------------------------------------------------------------------
-// Driver
-// ----------------------------------------------------------------------------
-
+/*
+ * Test the cached left-most and right-most nodes with TESTS random elements,
+ * popping from both ends until the tree is empty.
+ *
+ * This test assumes the insertion operation is correct and should not be used
+ * as the sole measure of correctness.
+ */
+void
+test_pop_random(void) {
+    struct rb_tree tree = rb_tree_init(cmp);
+    assert(!rb_peek_first(&tree) && !rb_peek_last(&tree));
+    struct rb_node *first = rb_pop_first(&tree);
+    struct rb_node *last = rb_pop_last(&tree);
+    assert(!first && !last);
+
+    struct box *boxes = malloc(TESTS * sizeof(struct box));
+    assert(boxes);
+
+    // Build up the tree.
+    for (ptrdiff_t i = 0; i < TESTS; i += 1) {
+        boxes[i].rb_node = rb_node_init();
+
+        // Generate a key until it isn't a duplicate.
+        do {
+            boxes[i].key = rand();
+        } while (!rb_insert(&tree, &boxes[i].rb_node));
+    }
+
+    assert(rb_is_valid(&tree));
+
+    // Reverse iteration should visit every node in decreasing order.
+    ptrdiff_t count = 0;
+    for (struct rb_node *node = rb_peek_last(&tree); node; node = rb_prev(node)) {
+        struct rb_node *prev = rb_prev(node);
+        assert(!prev || cmp(prev, node) < 0);
+        count += 1;
+    }
+    assert(count == TESTS);
+
+    // Pop from alternating ends. Each popped node must be the extreme.
+    struct box *low = NULL;
+    struct box *high = NULL;
+    for (ptrdiff_t i = 0; i < TESTS; i += 1) {
+        struct rb_node *expected = i % 2 == 0 ? rb_peek_first(&tree) : rb_peek_last(&tree);
+        struct rb_node *popped = i % 2 == 0 ? rb_pop_first(&tree) : rb_pop_last(&tree);
+        assert(popped == expected && !rb_is_linked(popped));
+
+        struct box *box = rb_entry(popped, struct box, rb_node);
+        if (i % 2 == 0) {
+            assert(!low || low->key < box->key);
+            low = box;
+        } else {
+            assert(!high || high->key > box->key);
+            high = box;
+        }
+    }
+
+    assert(rb_is_empty(&tree) && rb_is_valid(&tree));
+    assert(!rb_peek_first(&tree) && !rb_peek_last(&tree));
+
+    free(boxes);
+}
+
+/*
+ * Test the order-statistic operations with TESTS random elements, half of
+ * which are then erased, against in-order iteration.
+ *
+ * This test assumes the insertion, removal, and iteration operations are
+ * correct and should not be used as the sole measure of correctness.
+ */
+void
+test_sized_random(void) {
+    struct rb_tree tree = rb_tree_init_sized(sized_cmp);
+
+    struct sized_box *boxes = malloc(TESTS * sizeof(struct sized_box));
+    assert(boxes);
+
+    // Build up the tree.
+    for (ptrdiff_t i = 0; i < TESTS; i += 1) {
+        boxes[i].rb_node.rb_node = rb_node_init();
+
+        // Generate a key until it isn't a duplicate.
+        do {
+            boxes[i].key = rand();
+        } while (!rb_insert(&tree, &boxes[i].rb_node.rb_node));
+    }
+
+    // Erase half of the items, both with and without a search.
+    for (ptrdiff_t i = 0; i < TESTS / 2; i += 1) {
+        if (i % 2 == 0) {
+            rb_erase(&tree, &boxes[i].rb_node.rb_node);
+        } else {
+            struct rb_node *removed = rb_remove(&tree, &boxes[i].rb_node.rb_node);
+            assert(removed);
+        }
+    }
+
+    assert(rb_is_valid(&tree));
+
+    // Selection and rank must agree with the in-order position of each node.
+    size_t k = 0;
+    struct rb_node *node = NULL;
+    rb_for_each(tree, node) {
+        struct rb_sized_node *sized = rb_entry(node, struct rb_sized_node, rb_node);
+        size_t left = node->left ? rb_entry(node->left, struct rb_sized_node, rb_node)->size : 0;
+        size_t right = node->right ? rb_entry(node->right, struct rb_sized_node, rb_node)->size : 0;
+        assert(sized->size == left + right + 1);
+
+        assert(rb_select(&tree, k) == node);
+        assert(rb_rank(node) == k);
+        k += 1;
+    }
+
+    assert(k == TESTS - TESTS / 2);
+    assert(!rb_select(&tree, k));
+
+    // Counting a range must agree with the difference in rank of its ends.
+    for (ptrdiff_t i = 0; i < 1000; i += 1) {
+        struct rb_node *low = rb_select(&tree, rand() % k);
+        struct rb_node *high = rb_select(&tree, rand() % k);
+        size_t expected = rb_rank(low) <= rb_rank(high) ? rb_rank(high) - rb_rank(low) + 1 : 0;
+        assert(rb_count_range(&tree, low, high) == expected);
+    }
+
+    // Bounds that aren't in the tree count everything between them.
+    struct sized_box low = {.key = -1};
+    struct sized_box high = {.key = RAND_MAX};
+    assert(rb_count_range(&tree, &low.rb_node.rb_node, &high.rb_node.rb_node) == k);
+
+    free(boxes);
+}
+
+/*
+ * Test splitting an order-statistic tree of TESTS random elements at random
+ * keys, and joining the halves back together, many times over.
+ *
+ * This test assumes the insertion and order-statistic operations are correct
+ * and should not be used as the sole measure of correctness.
+ */
+void
+test_split_join(void) {
+    struct rb_tree tree = rb_tree_init_sized(sized_cmp);
+
+    struct sized_box *boxes = malloc(TESTS * sizeof(struct sized_box));
+    assert(boxes);
+
+    // Build up the tree.
+    for (ptrdiff_t i = 0; i < TESTS; i += 1) {
+        boxes[i].rb_node.rb_node = rb_node_init();
+
+        // Generate a key until it isn't a duplicate.
+        do {
+            boxes[i].key = rand();
+        } while (!rb_insert(&tree, &boxes[i].rb_node.rb_node));
+    }
+
+    for (ptrdiff_t i = 0; i < 10; i += 1) {
+        // Split at a key that is in the tree half of the time.
+        struct sized_box key;
+        key.key = i % 2 == 0 ? boxes[rand() % TESTS].key : rand();
+
+        struct rb_tree low;
+        struct rb_tree high;
+        rb_split(&tree, &key.rb_node.rb_node, &low, &high);
+        assert(rb_is_empty(&tree));
+        assert(rb_is_valid(&low) && rb_is_valid(&high));
+
+        size_t low_size = low.root ? rb_entry(low.root, struct rb_sized_node, rb_node)->size : 0;
+        size_t high_size = high.root ? rb_entry(high.root, struct rb_sized_node, rb_node)->size : 0;
+        assert(low_size + high_size == TESTS);
+        assert(!low.last || sized_cmp(low.last, &key.rb_node.rb_node) < 0);
+        assert(!high.first || sized_cmp(high.first, &key.rb_node.rb_node) >= 0);
+
+        // Join back together, using either end as the pivot.
+        struct rb_node *pivot = high.first ? rb_pop_first(&high) : rb_pop_last(&low);
+        rb_join(&low, pivot, &high);
+        assert(rb_is_empty(&high) && rb_is_valid(&low));
+        assert(rb_select(&low, TESTS - 1) == low.last);
+
+        tree = low;
+    }
+
+    // Joining trees of very different heights.
+    struct rb_tree small = rb_tree_init_sized(sized_cmp);
+    struct rb_tree large = rb_tree_init_sized(sized_cmp);
+    struct rb_node *pivot = rb_pop_first(&tree);
+    rb_join(&small, pivot, &tree);
+    assert(rb_is_valid(&small) && small.first == pivot);
+
+    pivot = rb_pop_last(&small);
+    rb_join(&small, pivot, &large);
+    assert(rb_is_valid(&small) && small.last == pivot);
+    assert(rb_select(&small, TESTS - 1) == pivot);
+
+    free(boxes);
+}
+
+/*
+ * Test moving a tree of TESTS random elements into a buffer in breadth-first
+ * order, and from there into another buffer in van Emde Boas order.
+ *
+ * This test assumes the insertion and search operations are correct and
+ * should not be used as the sole measure of correctness.
+ */
+void
+test_compact(void) {
+    struct rb_tree tree = rb_tree_init(cmp);
+
+    struct box *boxes = malloc(TESTS * sizeof(struct box));
+    struct box *bfs = malloc(TESTS * sizeof(struct box));
+    struct box *veb = malloc(TESTS * sizeof(struct box));
+    assert(boxes && bfs && veb);
+
+    // Compacting an empty tree moves nothing.
+    size_t moved = rb_compact(&tree, bfs, sizeof(struct box), offsetof(struct box, rb_node), RB_LAYOUT_BFS);
+    assert(moved == 0);
+
+    for (ptrdiff_t i = 0; i < TESTS; i += 1) {
+        boxes[i].rb_node = rb_node_init();
+        do {
+            boxes[i].key = rand();
+        } while (!rb_insert(&tree, &boxes[i].rb_node));
+    }
+
+    moved = rb_compact(&tree, bfs, sizeof(struct box), offsetof(struct box, rb_node), RB_LAYOUT_BFS);
+    assert(moved == TESTS);
+    assert(rb_is_valid(&tree));
+
+    // Each node's children come right after the nodes before it on its level.
+    assert(tree.root == &bfs[0].rb_node);
+    assert(bfs[0].rb_node.left == &bfs[1].rb_node && bfs[0].rb_node.right == &bfs[2].rb_node);
+
+    moved = rb_compact(&tree, veb, sizeof(struct box), offsetof(struct box, rb_node), RB_LAYOUT_VEB);
+    assert(moved == TESTS);
+    assert(rb_is_valid(&tree));
+    assert(tree.root == &veb[0].rb_node);
+
+    // Every key is still found, now in the last buffer.
+    for (ptrdiff_t i = 0; i < TESTS; i += 1) {
+        struct rb_node *found = rb_search(&tree, &boxes[i].rb_node);
+        assert(found && rb_entry(found, struct box, rb_node)->key == boxes[i].key);
+        assert(found >= &veb[0].rb_node && found <= &veb[TESTS - 1].rb_node);
+    }
+
+    free(veb);
+    free(bfs);
+    free(boxes);
+}
+
+/*
+ * Test profiling a complete tree built from 2^19 - 1 sorted nodes, whose shape
+ * is known, and then a tree of TESTS random nodes, before and after moving it
+ * into a buffer in van Emde Boas order.
+ */
+void
+test_profile(void) {
+    struct rb_tree tree = rb_tree_init(cmp);
+    struct rb_report report;
+
+    rb_profile(&tree, &report);
+    assert(report.nodes == 0 && report.max_depth == 0 && report.black_height == 0);
+
+    size_t n = ((size_t) 1 << 19) - 1;
+    struct box *boxes = malloc(TESTS * sizeof(struct box));
+    struct rb_node **nodes = malloc(TESTS * sizeof(struct rb_node *));
+    assert(boxes && nodes && n <= TESTS);
+
+    for (size_t i = 0; i < n; i += 1) {
+        boxes[i].key = i;
+        boxes[i].rb_node = rb_node_init();
+        nodes[i] = &boxes[i].rb_node;
+    }
+
+    rb_build_sorted(&tree, nodes, n);
+    rb_profile(&tree, &report);
+    assert(report.nodes == n && report.max_depth == 19);
+    for (size_t depth = 1; depth <= 19; depth += 1) {
+        assert(report.depths[depth] == (size_t) 1 << (depth - 1));
+    }
+
+    // The tree is complete, so either the whole bottom level is red or none of
+    // it is.
+    assert(report.black_height == 19 - report.red / ((size_t) 1 << 18));
+    assert(report.page_local > 0.0 && report.line_local <= report.page_local);
+
+    // Build a random tree, and check the report against a recursive pass.
+    tree = rb_tree_init(cmp);
+    for (ptrdiff_t i = 0; i < TESTS; i += 1) {
+        boxes[i].rb_node = rb_node_init();
+        do {
+            boxes[i].key = rand();
+        } while (!rb_insert(&tree, &boxes[i].rb_node));
+    }
+
+    rb_profile(&tree, &report);
+    assert(report.nodes == TESTS);
+
+    size_t total = 0;
+    size_t sum = 0;
+    for (size_t depth = 1; depth <= report.max_depth; depth += 1) {
+        total += report.depths[depth];
+        sum += depth * report.depths[depth];
+    }
+    assert(total == TESTS && report.depths[report.max_depth] > 0 && report.depths[report.max_depth + 1] == 0);
+    assert(report.average_depth == (double) sum / TESTS);
+
+    struct box *compact = malloc(TESTS * sizeof(struct box));
+    assert(compact);
+
+    // Most links are within a page once subtrees are laid out together.
+    double page_local = report.page_local;
+    rb_compact(&tree, compact, sizeof(struct box), offsetof(struct box, rb_node), RB_LAYOUT_VEB);
+    rb_profile(&tree, &report);
+    assert(report.nodes == TESTS && report.page_local > 0.5 && report.page_local > page_local);
+
+    free(compact);
+    free(nodes);
+    free(boxes);
+}
+
+/*
+ * Overwrite `size` bytes of a file at `offset`. Return false if that failed.
+ */
+static bool
+image_patch(const char *path, long offset, const void *data, size_t size) {
+    FILE *file = fopen(path, "r+b");
+    if (!file) {
+        return false;
+    }
+
+    bool patched = fseek(file, offset, SEEK_SET) == 0 && fwrite(data, size, 1, file) == 1;
+    return fclose(file) == 0 && patched;
+}
+
+/*
+ * Test writing a tree of TESTS random elements to an image, and searching and
+ * iterating it once mapped, as well as empty and corrupt images.
+ */
+void
+test_image(void) {
+    char path[64];
+    snprintf(path, sizeof(path), "/tmp/rb-test-%d.image", (int) getpid());
+
+    struct rb_tree tree = rb_tree_init(cmp);
+    struct rb_image image;
+
+    bool written = rb_image_write(&tree, path, sizeof(int), box_encode);
+    bool opened = rb_image_open(&image, path);
+    assert(written && opened);
+    assert(rb_image_count(&image) == 0 && !rb_image_first(&image) && !rb_image_last(&image));
+    int missing = 0;
+    assert(!rb_image_search(&image, &missing, box_image_cmp));
+    rb_image_close(&image);
+
+    struct box *boxes = malloc(TESTS * sizeof(struct box));
+    assert(boxes);
+
+    for (ptrdiff_t i = 0; i < TESTS; i += 1) {
+        boxes[i].rb_node = rb_node_init();
+        do {
+            boxes[i].key = rand();
+        } while (!rb_insert(&tree, &boxes[i].rb_node));
+    }
+
+    written = rb_image_write(&tree, path, sizeof(int), box_encode);
+    opened = rb_image_open(&image, path);
+    assert(written && opened);
+    assert(rb_image_count(&image) == TESTS);
+
+    for (ptrdiff_t i = 0; i < TESTS; i += 1) {
+        const int *found = rb_image_search(&image, &boxes[i].key, box_image_cmp);
+        assert(found && *found == boxes[i].key);
+
+        int absent = -boxes[i].key - 1;
+        assert(!rb_image_search(&image, &absent, box_image_cmp));
+    }
+
+    // Iterate in both directions alongside the tree.
+    struct rb_node *node = tree.first;
+    const int *data = NULL;
+    for (data = rb_image_first(&image); data; data = rb_image_next(&image, data)) {
+        assert(*data == rb_entry(node, struct box, rb_node)->key);
+        node = rb_next(node);
+    }
+    assert(!node);
+
+    node = tree.last;
+    for (data = rb_image_last(&image); data; data = rb_image_prev(&image, data)) {
+        assert(*data == rb_entry(node, struct box, rb_node)->key);
+        node = rb_prev(node);
+    }
+    assert(!node);
+
+    rb_image_close(&image);
+
+    // Images with the wrong magic, or cut short, are rejected.
+    bool patched = image_patch(path, 0, "X", 1);
+    opened = rb_image_open(&image, path);
+    assert(patched && !opened);
+
+    written = rb_image_write(&tree, path, sizeof(int), box_encode);
+    int truncated = truncate(path, 4096);
+    opened = rb_image_open(&image, path);
+    assert(written && truncated == 0 && !opened);
+
+    // So are headers whose sizes overflow, or whose root isn't a record. This
+    // data size wraps around to 0 once the 32 bytes of links are added to it.
+    uint64_t sizes[2] = {UINT64_MAX - 31, 0};
+    written = rb_image_write(&tree, path, sizeof(int), box_encode);
+    patched = image_patch(path, offsetof(struct rb_image_header, data_size), sizes, sizeof(sizes));
+    opened = rb_image_open(&image, path);
+    assert(written && patched && !opened);
+
+    uint64_t root = 8;
+    written = rb_image_write(&tree, path, sizeof(int), box_encode);
+    patched = image_patch(path, offsetof(struct rb_image_header, root), &root, sizeof(root));
+    opened = rb_image_open(&image, path);
+    assert(written && patched && !opened);
+
+    unlink(path);
+    free(boxes);
+}
+
+/*
+ * Test union, intersection, and difference of two sized trees, each holding a
+ * random half of the keys in [0, TESTS), using several threads.
+ *
+ * This test assumes the order statistics are correct and should not be used as
+ * the sole measure of correctness.
+ */
+void
+test_set_random(void) {
+    struct sized_box *a_boxes = malloc(TESTS * sizeof(struct sized_box));
+    struct sized_box *b_boxes = malloc(TESTS * sizeof(struct sized_box));
+    struct rb_node **nodes = malloc(TESTS * sizeof(struct rb_node *));
+    unsigned char *members = malloc(TESTS); // Bit 0 if the key is in `a`, bit 1 if it is in `b`.
+    assert(a_boxes && b_boxes && nodes && members);
+
+    void (*ops[])(struct rb_tree *, struct rb_tree *, unsigned) = {rb_union, rb_intersect, rb_difference};
+
+    for (ptrdiff_t op = 0; op < 3; op += 1) {
+        struct rb_tree a = rb_tree_init_sized(sized_cmp);
+        struct rb_tree b = rb_tree_init_sized(sized_cmp);
+
+        for (ptrdiff_t i = 0; i < TESTS; i += 1) {
+            members[i] = rand() % 4;
+        }
+
+        // Build both trees from their members.
+        struct rb_tree *trees[] = {&a, &b};
+        struct sized_box *boxes[] = {a_boxes, b_boxes};
+        for (ptrdiff_t t = 0; t < 2; t += 1) {
+            size_t n = 0;
+            for (ptrdiff_t i = 0; i < TESTS; i += 1) {
+                boxes[t][i].key = i;
+                boxes[t][i].rb_node.rb_node = rb_node_init();
+                if (members[i] & (1 << t)) {
+                    nodes[n] = &boxes[t][i].rb_node.rb_node;
+                    n += 1;
+                }
+            }
+
+            rb_build_sorted(trees[t], nodes, n);
+        }
+
+        ops[op](&a, &b, 4);
+        assert(rb_is_empty(&b) && rb_is_valid(&a));
+
+        // Check that each key ended up in the result exactly when it should,
+        // with the node from `a` preferred, and that the rest were unlinked.
+        size_t expected = 0;
+        for (ptrdiff_t i = 0; i < TESTS; i += 1) {
+            bool in_a = members[i] & 1;
+            bool in_b = members[i] & 2;
+            bool keep_a = op == 0 ? in_a : op == 1 ? in_a && in_b : in_a && !in_b;
+            bool keep_b = op == 0 && in_b && !in_a;
+
+            struct rb_node *a_node = &a_boxes[i].rb_node.rb_node;
+            struct rb_node *b_node = &b_boxes[i].rb_node.rb_node;
+            assert(rb_is_linked(a_node) == keep_a);
+            assert(rb_is_linked(b_node) == keep_b);
+
+            struct rb_node *found = rb_search(&a, a_node);
+            assert(found == (keep_a ? a_node : keep_b ? b_node : NULL));
+            expected += keep_a || keep_b;
+        }
+
+        size_t size = a.root ? rb_entry(a.root, struct rb_sized_node, rb_node)->size : 0;
+        assert(size == expected);
+    }
+
+    free(members);
+    free(nodes);
+    free(b_boxes);
+    free(a_boxes);
+}
+
+/*
+ * Test an owning map from int to double over the keys in [0, TESTS), inserted
+ * in a random order, deleting and then putting back the even keys, which
+ * should reuse the freed entries.
+ */
+void
+test_map_random(void) {
+    struct rb_map map = rb_map_init(sizeof(int), sizeof(double), int_cmp);
+
+    int *keys = malloc(TESTS * sizeof(int));
+    assert(keys);
+
+    for (int i = 0; i < TESTS; i += 1) {
+        keys[i] = i;
+    }
+
+    for (int i = TESTS - 1; i > 0; i -= 1) {
+        int j = rand() % (i + 1);
+        int tmp = keys[i];
+        keys[i] = keys[j];
+        keys[j] = tmp;
+    }
+
+    for (int i = 0; i < TESTS; i += 1) {
+        double value = keys[i] / 2.0;
+        double *stored = rb_map_put(&map, &keys[i], &value);
+        assert(stored && *stored == value && (uintptr_t) stored % _Alignof(double) == 0);
+    }
+
+    assert(map.size == TESTS);
+
+    // Delete the even keys.
+    for (int key = 0; key < TESTS; key += 2) {
+        bool deleted = rb_map_del(&map, &key);
+        assert(deleted && !rb_map_get(&map, &key));
+        deleted = rb_map_del(&map, &key);
+        assert(!deleted);
+    }
+
+    assert(map.size == TESTS / 2);
+
+    // Put them back, along with new values for the odd keys. No new memory is
+    // needed.
+    struct rb_map_slab *slabs = map.slabs;
+    unsigned char *unused = map.unused;
+
+    for (int key = 0; key < TESTS; key += 1) {
+        double value = -key;
+        double *stored = rb_map_put(&map, &key, &value);
+        assert(stored);
+    }
+
+    assert(map.size == TESTS && map.slabs == slabs && map.unused == unused && !map.free);
+
+    // Iterate in key order, checking every value.
+    int expected = 0;
+    struct rb_map_entry *entry = NULL;
+    rb_map_for_each(&map, entry) {
+        assert(*(const int *) rb_map_key(&map, entry) == expected);
+        assert(*(double *) rb_map_value(&map, entry) == -expected);
+        expected += 1;
+    }
+    assert(expected == TESTS);
+
+    // Release everything at once, and start over.
+    rb_map_clear(&map);
+    assert(map.size == 0 && !map.slabs && !rb_map_first(&map));
+
+    double value = 1.0;
+    double *stored = rb_map_put(&map, &keys[0], &value);
+    assert(stored && *(double *) rb_map_get(&map, &keys[0]) == 1.0);
+    rb_map_clear(&map);
+
+    free(keys);
+}
+
+/*
+ * Test a uint64_t-keyed tree over TESTS random keys spread across the whole
+ * range, half of which are then removed, checking bounds along the way.
+ *
+ * This test assumes the validity check is correct and should not be used as
+ * the sole measure of correctness.
+ */
+void
+test_u64_random(void) {
+    struct rb_tree tree = rb_u64_tree_init();
+
+    struct rb_u64_node *nodes = malloc(TESTS * sizeof(struct rb_u64_node));
+    assert(nodes);
+
+    for (ptrdiff_t i = 0; i < TESTS; i += 1) {
+        do {
+            nodes[i] = rb_u64_node_init((uint64_t) rand() << 33 ^ (uint64_t) rand() << 2);
+        } while (!rb_u64_insert(&tree, &nodes[i]));
+    }
+
+    assert(rb_is_valid(&tree));
+
+    for (ptrdiff_t i = 0; i < TESTS; i += 1) {
+        uint64_t key = nodes[i].key;
+        assert(rb_u64_search(&tree, key) == &nodes[i]);
+        assert(rb_u64_lower_bound(&tree, key) == &nodes[i]);
+
+        // Keys are multiples of 4, so the neighbours aren't in the tree.
+        assert(!rb_u64_search(&tree, key + 1));
+        struct rb_node *next = rb_next(&nodes[i].rb_node);
+        struct rb_u64_node *bound = rb_u64_lower_bound(&tree, key + 1);
+        assert(bound == (next ? rb_entry(next, struct rb_u64_node, rb_node) : NULL));
+    }
+
+    for (ptrdiff_t i = 0; i < TESTS; i += 2) {
+        struct rb_u64_node *removed = rb_u64_remove(&tree, nodes[i].key);
+        assert(removed == &nodes[i]);
+        removed = rb_u64_remove(&tree, nodes[i].key);
+        assert(!removed);
+    }
+
+    assert(rb_is_valid(&tree));
+    free(nodes);
+}
+
+/*
+ * Test an index-linked tree over an array of TESTS random elements, removing
+ * half of them by key, and then growing the array with realloc() and inserting
+ * more elements.
+ *
+ * This test assumes the validity check is correct and should not be used as
+ * the sole measure of correctness.
+ */
+void
+test_rb32_random(void) {
+    struct box32 *boxes = malloc(TESTS * sizeof(struct box32));
+    assert(boxes);
+
+    struct rb32_tree tree = rb32_tree_init(boxes, sizeof(struct box32), offsetof(struct box32, rb_node), box32_cmp);
+
+    // Build up the tree.
+    for (uint32_t i = 0; i < TESTS; i += 1) {
+        boxes[i].rb_node = rb32_node_init();
+
+        // Generate a key until it isn't a duplicate.
+        do {
+            boxes[i].key = rand();
+        } while (!rb32_insert(&tree, i));
+    }
+
+    assert(rb32_is_valid(&tree));
+
+    // Remove every other element by key, searching for the rest.
+    for (uint32_t i = 0; i < TESTS; i += 1) {
+        struct box32 key;
+        key.key = boxes[i].key;
+
+        if (i % 2 == 0) {
+            uint32_t removed = rb32_remove(&tree, &key);
+            assert(removed == i);
+            assert(!rb32_is_linked(&boxes[i].rb_node));
+        } else {
+            assert(rb32_search(&tree, &key) == i);
+        }
+    }
+
+    assert(rb32_is_valid(&tree));
+
+    // Links are indices, so they survive the array moving.
+    boxes = realloc(boxes, 2 * TESTS * sizeof(struct box32));
+    assert(boxes);
+    tree.base = (unsigned char *) boxes;
+
+    for (uint32_t i = TESTS; i < 2 * TESTS; i += 1) {
+        boxes[i].rb_node = rb32_node_init();
+        do {
+            boxes[i].key = rand();
+        } while (!rb32_insert(&tree, i));
+    }
+
+    assert(rb32_is_valid(&tree));
+
+    // Iterate in both directions, and empty the tree from the front.
+    size_t count = 0;
+    uint32_t index = RB32_NIL;
+    rb32_for_each(&tree, index) {
+        count += 1;
+    }
+    assert(count == TESTS + TESTS / 2);
+
+    for (index = tree.last; index != RB32_NIL; index = rb32_prev(&tree, index)) {
+        count -= 1;
+    }
+    assert(count == 0);
+
+    while (tree.first != RB32_NIL) {
+        rb32_erase(&tree, tree.first);
+    }
+
+    assert(tree.root == RB32_NIL && tree.last == RB32_NIL);
+    free(boxes);
+}
+
+/*
+ * Test lock-free searches of a latch tree while a writer updates it. Even keys
+ * in [0, LATCH_TESTS) stay in the tree throughout, so readers must always find
+ * them, while the writer repeatedly inserts and erases the odd keys.
+ */
+#define LATCH_TESTS 100000
+#define LATCH_READERS 3
+
+struct latch_test {
+    struct rb_latch_tree tree;
+    struct latch_box *boxes;
+    bool done;
+};
+
+static void *
+latch_reader(void *arg) {
+    struct latch_test *test = arg;
+    unsigned seed = (unsigned) (uintptr_t) &seed;
+
+    while (!__atomic_load_n(&test->done, __ATOMIC_RELAXED)) {
+        struct latch_box key;
+        key.key = rand_r(&seed) % LATCH_TESTS;
+
+        struct rb_latch_node *found = rb_latch_search(&test->tree, &key.rb_node);
+        if (key.key % 2 == 0) {
+            assert(found == &test->boxes[key.key].rb_node);
+        } else {
+            assert(!found || found == &test->boxes[key.key].rb_node);
+        }
+    }
+
+    return NULL;
+}
+
+void
+test_latch_concurrent(void) {
+    struct latch_test test;
+    test.tree = rb_latch_tree_init(latch_cmp);
+    test.boxes = malloc(LATCH_TESTS * sizeof(struct latch_box));
+    test.done = false;
+    assert(test.boxes);
+
+    for (ptrdiff_t i = 0; i < LATCH_TESTS; i += 1) {
+        test.boxes[i].key = i;
+        test.boxes[i].rb_node = rb_latch_node_init();
+        if (i % 2 == 0) {
+            bool inserted = rb_latch_insert(&test.tree, &test.boxes[i].rb_node);
+            assert(inserted);
+        }
+    }
+
+    pthread_t readers[LATCH_READERS];
+    for (ptrdiff_t i = 0; i < LATCH_READERS; i += 1) {
+        int created = pthread_create(&readers[i], NULL, latch_reader, &test);
+        assert(created == 0);
+    }
+
+    for (ptrdiff_t round = 0; round < 10; round += 1) {
+        for (ptrdiff_t i = 1; i < LATCH_TESTS; i += 2) {
+            bool inserted = rb_latch_insert(&test.tree, &test.boxes[i].rb_node);
+            assert(inserted);
+            inserted = rb_latch_insert(&test.tree, &test.boxes[i].rb_node);
+            assert(!inserted);
+        }
+
+        for (ptrdiff_t i = 1; i < LATCH_TESTS; i += 2) {
+            rb_latch_erase(&test.tree, &test.boxes[i].rb_node);
+        }
+    }
+
+    __atomic_store_n(&test.done, true, __ATOMIC_RELAXED);
+    for (ptrdiff_t i = 0; i < LATCH_READERS; i += 1) {
+        pthread_join(readers[i], NULL);
+    }
+
+    // Both copies should hold exactly the even keys.
+    struct rb_tree copy_0 = test.tree.tree[0];
+    struct rb_tree copy_1 = test.tree.tree[1];
+    copy_0.cmp = latch_cmp_0;
+    copy_1.cmp = latch_cmp_1;
+    assert(rb_is_valid(&copy_0) && rb_is_valid(&copy_1));
+
+    for (ptrdiff_t i = 0; i < LATCH_TESTS; i += 1) {
+        struct rb_latch_node *found = rb_latch_search(&test.tree, &test.boxes[i].rb_node);
+        assert(found == (i % 2 == 0 ? &test.boxes[i].rb_node : NULL));
+    }
+
+    free(test.boxes);
+}
+
+/*
+ * Test a sharded map, with several threads inserting and then removing
+ * disjoint sets of keys at once, and with rebalancing after all of the keys
+ * have landed in one shard and after the lower shards have been emptied.
+ */
+#define SHARD_TESTS 100000
+#define SHARD_COUNT 8
+#define SHARD_THREADS 4
+
+struct shard_test {
+    struct rb_shard_map *map;
+    struct sized_box *boxes;
+    ptrdiff_t thread;
+    bool insert;
+};
+
+static void
+shard_copy(struct rb_node *dst, struct rb_node *src) {
+    rb_entry(dst, struct sized_box, rb_node.rb_node)->key = rb_entry(src, struct sized_box, rb_node.rb_node)->key;
+}
+
+static void *
+shard_worker(void *arg) {
+    struct shard_test *test = arg;
+    for (ptrdiff_t i = test->thread; i < SHARD_TESTS; i += SHARD_THREADS) {
+        struct rb_node *node = &test->boxes[i].rb_node.rb_node;
+        if (test->insert) {
+            bool inserted = rb_shard_insert(test->map, node);
+            assert(inserted);
+        } else if (i < SHARD_TESTS / 2) {
+            struct rb_node *removed = rb_shard_remove(test->map, node);
+            assert(removed == node);
+        }
+    }
+
+    return NULL;
+}
+
+static void
+shard_run(struct rb_shard_map *map, struct sized_box *boxes, bool insert) {
+    pthread_t threads[SHARD_THREADS];
+    struct shard_test tests[SHARD_THREADS];
+    for (ptrdiff_t i = 0; i < SHARD_THREADS; i += 1) {
+        tests[i] = (struct shard_test) {map, boxes, i, insert};
+        int created = pthread_create(&threads[i], NULL, shard_worker, &tests[i]);
+        assert(created == 0);
+    }
+
+    for (ptrdiff_t i = 0; i < SHARD_THREADS; i += 1) {
+        pthread_join(threads[i], NULL);
+    }
+}
+
+#ifdef RB_STATS
+static uint64_t
+shard_comparisons(struct rb_shard_map *map) {
+    uint64_t comparisons = 0;
+    for (size_t i = 0; i < map->nshards; i += 1) {
+        comparisons += map->shards[i].tree.stats.comparisons;
+    }
+
+    return comparisons;
+}
+#endif
+
+void
+test_shard_concurrent(void) {
+    struct sized_box *boxes = malloc(SHARD_TESTS * sizeof(struct sized_box));
+    assert(boxes);
+
+    for (ptrdiff_t i = 0; i < SHARD_TESTS; i += 1) {
+        boxes[i].key = i;
+        boxes[i].rb_node.rb_node = rb_node_init();
+    }
+
+    // Start with every boundary below all of the keys, so that the last shard
+    // gets everything.
+    struct sized_box bounds[SHARD_COUNT - 1];
+    struct rb_node *bound_nodes[SHARD_COUNT - 1];
+    for (ptrdiff_t i = 0; i < SHARD_COUNT - 1; i += 1) {
+        bounds[i].key = -SHARD_COUNT + i;
+        bound_nodes[i] = &bounds[i].rb_node.rb_node;
+    }
+
+    struct rb_shard_map map;
+    bool initialized = rb_shard_map_init(&map, sized_cmp, shard_copy, bound_nodes, 0);
+    assert(!initialized);
+    initialized = rb_shard_map_init(&map, sized_cmp, shard_copy, bound_nodes, SHARD_COUNT);
+    assert(initialized);
+
+    shard_run(&map, boxes, true);
+    assert(rb_shard_size(&map) == SHARD_TESTS);
+    bool inserted = rb_shard_insert(&map, &boxes[0].rb_node.rb_node);
+    assert(!inserted);
+
+    for (ptrdiff_t round = 0; round < 2; round += 1) {
+#ifdef RB_STATS
+        // Moving nodes between shards keeps every shard's stats.
+        uint64_t comparisons = shard_comparisons(&map);
+        rb_shard_rebalance(&map);
+        assert(shard_comparisons(&map) > comparisons);
+#else
+        rb_shard_rebalance(&map);
+#endif
+
+        size_t expected = rb_shard_size(&map);
+        for (ptrdiff_t i = 0; i < SHARD_COUNT; i += 1) {
+            struct rb_tree *tree = &map.shards[i].tree;
+            size_t size = tree->root ? rb_entry(tree->root, struct rb_sized_node, rb_node)->size : 0;
+            assert(size == expected / SHARD_COUNT || size == expected / SHARD_COUNT + 1);
+            assert(rb_is_valid(tree));
+        }
+
+        // Iterate in order across the shards.
+        ptrdiff_t key = round == 0 ? 0 : SHARD_TESTS / 2;
+        for (struct rb_node *node = rb_shard_first(&map); node; node = rb_shard_next(&map, node)) {
+            assert(rb_entry(node, struct sized_box, rb_node.rb_node)->key == key);
+            assert(rb_shard_search(&map, node) == node);
+            key += 1;
+        }
+        assert(key == SHARD_TESTS);
+
+        // Remove the lower half of the keys, which empties the lower shards.
+        if (round == 0) {
+            shard_run(&map, boxes, false);
+            assert(rb_shard_size(&map) == SHARD_TESTS / 2);
+            assert(!rb_shard_search(&map, &boxes[0].rb_node.rb_node));
+        }
+    }
+
+    rb_shard_map_destroy(&map);
+    free(boxes);
+}
+
+/*
+ * Test persistent versions, with several readers walking snapshots of a
+ * version while the writer removes half of its keys and changes the values of
+ * the rest. Each snapshot must keep seeing the version as it was when taken.
+ * Each reader then updates its own snapshot, so that several versions sharing
+ * nodes are updated at once.
+ */
+#define PERSIST_TESTS 100000
+#define PERSIST_READERS 3
+
+struct persist_test {
+    struct rb_persist *persist;
+    struct rb_version snapshot;
+};
+
+static void *
+persist_reader(void *arg) {
+    struct persist_test *test = arg;
+    for (ptrdiff_t round = 0; round < 10; round += 1) {
+        int expected = 0;
+        struct rb_persist_cursor cursor;
+        for (struct rb_persist_node *node = rb_persist_first(&cursor, &test->snapshot); node;
+             node = rb_persist_next(&cursor)) {
+            assert(*(const int *) rb_persist_key(test->persist, node) == expected);
+            assert(*(const int *) rb_persist_value(test->persist, node) == expected);
+            expected += 1;
+        }
+        assert(expected == PERSIST_TESTS);
+    }
+
+    for (int key = 0; key < PERSIST_TESTS; key += 3) {
+        bool deleted = rb_persist_del(test->persist, &test->snapshot, &key);
+        assert(deleted);
+    }
+
+    assert(test->snapshot.size == PERSIST_TESTS - (PERSIST_TESTS + 2) / 3);
+    assert(rb_persist_is_valid(test->persist, &test->snapshot));
+
+    // Drop the snapshot from this thread, while the writer may be copying
+    // some of its nodes.
+    rb_version_release(test->persist, &test->snapshot);
+    return NULL;
+}
+
+void
+test_persist_concurrent(void) {
+    struct rb_persist persist = rb_persist_init(sizeof(int), sizeof(int), int_cmp);
+    struct rb_version version = rb_version_init();
+
+    int *keys = malloc(PERSIST_TESTS * sizeof(int));
+    assert(keys);
+
+    for (int i = 0; i < PERSIST_TESTS; i += 1) {
+        keys[i] = i;
+    }
+
+    for (int i = PERSIST_TESTS - 1; i > 0; i -= 1) {
+        int j = rand() % (i + 1);
+        int tmp = keys[i];
+        keys[i] = keys[j];
+        keys[j] = tmp;
+    }
+
+    for (int i = 0; i < PERSIST_TESTS; i += 1) {
+        bool put = rb_persist_put(&persist, &version, &keys[i], &keys[i]);
+        assert(put);
+    }
+
+    assert(version.size == PERSIST_TESTS && persist.nodes == PERSIST_TESTS);
+    assert(rb_persist_is_valid(&persist, &version));
+
+    // Taking a snapshot copies nothing, and an update after it copies only
+    // the path to the key it changes.
+    struct rb_version snapshot = rb_version_snapshot(&version);
+    assert(snapshot.root == version.root && persist.nodes == PERSIST_TESTS);
+
+    int key = PERSIST_TESTS / 2;
+    int value = -key;
+    bool put = rb_persist_put(&persist, &version, &key, &value);
+    assert(put);
+    assert(version.size == PERSIST_TESTS && persist.nodes - PERSIST_TESTS < RB_MAX_HEIGHT);
+    assert(*(const int *) rb_persist_get(&persist, &version, &key) == -key);
+    assert(*(const int *) rb_persist_get(&persist, &snapshot, &key) == key);
+
+    // Go back to the snapshot, which frees the copies.
+    rb_version_release(&persist, &version);
+    version = snapshot;
+    assert(persist.nodes == PERSIST_TESTS);
+
+    pthread_t readers[PERSIST_READERS];
+    struct persist_test tests[PERSIST_READERS];
+    for (ptrdiff_t i = 0; i < PERSIST_READERS; i += 1) {
+        tests[i] = (struct persist_test) {&persist, rb_version_snapshot(&version)};
+        int created = pthread_create(&readers[i], NULL, persist_reader, &tests[i]);
+        assert(created == 0);
+    }
+
+    // Remove the even keys and negate the values of the odd ones. Removing a
+    // key that isn't there still rebalances, so the tree is checked as it goes.
+    snapshot = rb_version_snapshot(&version);
+    for (int i = 0; i < PERSIST_TESTS; i += 1) {
+        if (keys[i] % 2 == 0) {
+            bool deleted = rb_persist_del(&persist, &version, &keys[i]);
+            assert(deleted);
+            deleted = rb_persist_del(&persist, &version, &keys[i]);
+            assert(!deleted);
+        } else {
+            value = -keys[i];
+            put = rb_persist_put(&persist, &version, &keys[i], &value);
+            assert(put);
+        }
+
+        if (i % 1000 == 0) {
+            assert(rb_persist_is_valid(&persist, &version));
+        }
+    }
+
+    int outside[] = {-1, PERSIST_TESTS};
+    for (size_t i = 0; i < 2; i += 1) {
+        bool deleted = rb_persist_del(&persist, &version, &outside[i]);
+        assert(!deleted);
+    }
+
+    for (ptrdiff_t i = 0; i < PERSIST_READERS; i += 1) {
+        pthread_join(readers[i], NULL);
+    }
+
+    assert(version.size == PERSIST_TESTS / 2 && rb_persist_is_valid(&persist, &version));
+    assert(snapshot.size == PERSIST_TESTS && rb_persist_is_valid(&persist, &snapshot));
+
+    for (key = 0; key < PERSIST_TESTS; key += 1) {
+        const int *found = rb_persist_get(&persist, &version, &key);
+        assert(key % 2 == 0 ? !found : *found == -key);
+        assert(*(const int *) rb_persist_get(&persist, &snapshot, &key) == key);
+    }
+
+    // Releasing every version frees every node.
+    rb_version_release(&persist, &snapshot);
+    assert(persist.nodes == PERSIST_TESTS / 2 && rb_persist_is_valid(&persist, &version));
+
+    rb_version_release(&persist, &version);
+    assert(persist.nodes == 0 && !version.root);
+
+    free(keys);
+}
+
+/*
+ * Test a tree augmented through RB_DECLARE_AUGMENT() with the greatest key of
+ * each subtree, over TESTS random elements, half of which are then erased.
+ *
+ * This test assumes the insertion and removal operations are correct and
+ * should not be used as the sole measure of correctness.
+ */
+void
+test_augment_random(void) {
+    struct rb_tree tree = rb_tree_init_augmented(max_cmp, &max_augment);
+
+    struct max_box *boxes = malloc(TESTS * sizeof(struct max_box));
+    assert(boxes);
+
+    // Build up the tree.
+    for (ptrdiff_t i = 0; i < TESTS; i += 1) {
+        boxes[i].rb_node = rb_node_init();
+
+        // Generate a key until it isn't a duplicate.
+        do {
+            boxes[i].key = rand();
+        } while (!rb_insert(&tree, &boxes[i].rb_node));
+    }
+
+    // Erase half of the items, always including the current maximum so that
+    // the root's value has to change.
+    for (ptrdiff_t i = 0; i < TESTS / 2; i += 1) {
+        if (i % 2 != 0) {
+            rb_pop_last(&tree);
+        } else if (rb_is_linked(&boxes[i].rb_node)) {
+            rb_erase(&tree, &boxes[i].rb_node);
+        }
+    }
+
+    assert(rb_is_valid(&tree));
+
+    // Every node's value must match its own key and its children's values.
+    struct rb_node *node = NULL;
+    rb_for_each(tree, node) {
+        struct max_box *box = rb_entry(node, struct max_box, rb_node);
+        assert(box->max == max_compute(box));
+    }
+
+    assert(rb_entry(tree.root, struct max_box, rb_node)->max ==
+           rb_entry(rb_peek_last(&tree), struct max_box, rb_node)->key);
+
+    free(boxes);
+}
+
+/*
+ * Test overlap queries on an interval tree of TESTS / 100 random intervals,
+ * half of which are then removed, against a linear scan.
+ *
+ * This test does not rely on any other test and can be assumed to be a measure
+ * of correctness for interval trees.
+ */
+void
+test_interval_random(void) {
+    const ptrdiff_t n = TESTS / 100;
+    struct rb_tree tree = rb_interval_tree_init();
+
+    struct rb_interval *intervals = malloc(n * sizeof(struct rb_interval));
+    assert(intervals);
+
+    // Intervals may share bounds.
+    for (ptrdiff_t i = 0; i < n; i += 1) {
+        uint64_t start = rand() % (10 * n);
+        intervals[i] = rb_interval_init(start, start + 1 + rand() % 100);
+        rb_interval_insert(&tree, &intervals[i]);
+    }
+
+    for (int round = 0; round < 2; round += 1) {
+        assert(rb_is_valid(&tree));
+
+        for (ptrdiff_t q = 0; q < 1000; q += 1) {
+            uint64_t start = rand() % (10 * n);
+            uint64_t end = start + 1 + rand() % 200;
+
+            // Every overlapping interval must be visited once, in order.
+            ptrdiff_t found = 0;
+            struct rb_interval *prev = NULL;
+            struct rb_interval *interval = NULL;
+            rb_interval_for_each(&tree, interval, start, end) {
+                assert(interval->start < end && start < interval->end);
+                assert(!prev || prev->start <= interval->start);
+                prev = interval;
+                found += 1;
+            }
+
+            ptrdiff_t expected = 0;
+            for (ptrdiff_t i = 0; i < n; i += 1) {
+                if (rb_is_linked(&intervals[i].rb_node) && intervals[i].start < end && start < intervals[i].end) {
+                    expected += 1;
+                }
+            }
+
+            assert(found == expected);
+        }
+
+        // Remove half of the intervals and query again.
+        for (ptrdiff_t i = 0; round == 0 && i < n; i += 2) {
+            rb_interval_remove(&tree, &intervals[i]);
+        }
+    }
+
+    free(intervals);
+}
+
+/*
+ * Test the functions generated by RB_GENERATE() with TESTS random elements:
+ * insertion, search, in-order iteration, and removal of half of the elements.
+ */
+void
+test_generated_random(void) {
+    struct rb_tree tree = rb_tree_init(box_tree_cmp);
+
+    struct box *boxes = malloc(TESTS * sizeof(struct box));
+    assert(boxes);
+
+    // Build up the tree.
+    for (ptrdiff_t i = 0; i < TESTS; i += 1) {
+        boxes[i].rb_node = rb_node_init();
+
+        // Generate a key until it isn't a duplicate.
+        do {
+            boxes[i].key = rand();
+        } while (!box_tree_insert(&tree, &boxes[i]));
+    }
+
+    assert(rb_is_valid(&tree));
+
+    // Search for elements that should and should not be in the tree.
+    for (ptrdiff_t i = 0; i < TESTS; i += 1) {
+        struct box box;
+        box.key = boxes[i].key;
+        assert(box_tree_search(&tree, &box) == &boxes[i]);
+
+        box.key = -boxes[i].key - 1;
+        assert(!box_tree_search(&tree, &box));
+    }
+
+    // Iterate over the tree in order.
+    ptrdiff_t count = 0;
+    for (struct box *box = box_tree_first(&tree); box; box = box_tree_next(box)) {
+        struct box *next = box_tree_next(box);
+        assert(!next || box->key < next->key);
+        count += 1;
+    }
+    assert(count == TESTS);
+
+    // Remove half of the items from the tree.
+    for (ptrdiff_t i = 0; i < TESTS / 2; i += 1) {
+        struct box *removed = box_tree_remove(&tree, &boxes[i]);
+        assert(removed == &boxes[i]);
+        assert(!box_tree_search(&tree, &boxes[i]));
+    }
+
+    assert(rb_is_valid(&tree));
+
+    free(boxes);
+}
+
+// ----------------------------------------------------------------------------
+// Driver
+// ----------------------------------------------------------------------------
+
 int
 main(void) {
     unsigned long t = time(NULL);
@@ -438,16 +2190,21 @@ main(void) {
     fprintf(stderr, "Testing insertion... ");
     test_insert_inorder();
     test_insert_random();
+    test_insert_split();
+    test_build_sorted();
     fprintf(stderr, "passed\n");
 
     fprintf(stderr, "Testing search... ");
     test_search_inorder();
     test_search_random();
+    test_search_bounds();
+    test_search_batch();
     fprintf(stderr, "passed\n");
 
     fprintf(stderr, "Testing removal... ");
     test_remove_inorder();
     test_remove_random();
+    test_erase_random();
     fprintf(stderr, "passed\n");
 
     fprintf(stderr, "Testing all together... ");
@@ -455,5 +2212,79 @@ main(void) {
     test_all_random();
     fprintf(stderr, "passed\n");
 
+    fprintf(stderr, "Testing first and last... ");
+    test_pop_random();
+    fprintf(stderr, "passed\n");
+
+#ifdef RB_STATS
+    fprintf(stderr, "Testing stats... ");
+    test_stats();
+    fprintf(stderr, "passed\n");
+#endif
+
+    fprintf(stderr, "Testing cursors... ");
+    test_cursor();
+    fprintf(stderr, "passed\n");
+
+    fprintf(stderr, "Testing order statistics... ");
+    test_sized_random();
+    fprintf(stderr, "passed\n");
+
+    fprintf(stderr, "Testing split and join... ");
+    test_split_join();
+    fprintf(stderr, "passed\n");
+
+    fprintf(stderr, "Testing compaction... ");
+    test_compact();
+    fprintf(stderr, "passed\n");
+
+    fprintf(stderr, "Testing profiling... ");
+    test_profile();
+    fprintf(stderr, "passed\n");
+
+    fprintf(stderr, "Testing images... ");
+    test_image();
+    fprintf(stderr, "passed\n");
+
+    fprintf(stderr, "Testing set operations... ");
+    test_set_random();
+    fprintf(stderr, "passed\n");
+
+    fprintf(stderr, "Testing augmentation... ");
+    test_augment_random();
+    fprintf(stderr, "passed\n");
+
+    fprintf(stderr, "Testing interval trees... ");
+    test_interval_random();
+    fprintf(stderr, "passed\n");
+
+    fprintf(stderr, "Testing owning maps... ");
+    test_map_random();
+    fprintf(stderr, "passed\n");
+
+    fprintf(stderr, "Testing integer-keyed trees... ");
+    test_u64_random();
+    fprintf(stderr, "passed\n");
+
+    fprintf(stderr, "Testing 32-bit index trees... ");
+    test_rb32_random();
+    fprintf(stderr, "passed\n");
+
+    fprintf(stderr, "Testing latch trees... ");
+    test_latch_concurrent();
+    fprintf(stderr, "passed\n");
+
+    fprintf(stderr, "Testing sharded maps... ");
+    test_shard_concurrent();
+    fprintf(stderr, "passed\n");
+
+    fprintf(stderr, "Testing persistent versions... ");
+    test_persist_concurrent();
+    fprintf(stderr, "passed\n");
+
+    fprintf(stderr, "Testing generated functions... ");
+    test_generated_random();
+    fprintf(stderr, "passed\n");
+
     return EXIT_SUCCESS;
 }
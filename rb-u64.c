@@ -0,0 +1,22 @@
+#include "rb-u64.h"
+#include <stdint.h>
+
+static int
+rb_u64_cmp(struct rb_node *left, struct rb_node *right) {
+    uint64_t l = RB_U64_KEY(left);
+    uint64_t r = RB_U64_KEY(right);
+    return (l > r) - (l < r);
+}
+
+struct rb_tree
+rb_u64_tree_init(void) {
+    return rb_tree_init(rb_u64_cmp);
+}
+
+struct rb_u64_node
+rb_u64_node_init(uint64_t key) {
+    struct rb_u64_node node;
+    node.rb_node = rb_node_init();
+    node.key = key;
+    return node;
+}
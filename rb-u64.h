@@ -0,0 +1,120 @@
+#ifndef RB_U64_H
+#define RB_U64_H
+
+#include "rb.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * A red-black tree keyed by a uint64_t stored right after the links, so that
+ * a descent only ever touches the nodes themselves, one cache line per level,
+ * rather than also loading keys from the elements that contain them.
+ *
+ * The functions below compare keys inline and pick each child without a
+ * branch. The tree is an ordinary struct rb_tree, so every rb_* function that
+ * doesn't compare, such as rb_erase() and rb_next(), works on it too, as does
+ * anything that does, since its comparison function compares the keys.
+ */
+struct rb_u64_node {
+    struct rb_node rb_node;
+    uint64_t key;
+};
+
+/*
+ * Return the link to the left child if `right` is 0, or to the right child if
+ * it is 1, without branching.
+ */
+#define RB_U64_CHILD(NODE, RIGHT)                                                                                      \
+    ((struct rb_node **) ((char *) (NODE) + offsetof(struct rb_node, left) +                                           \
+                          (size_t) (RIGHT) * (offsetof(struct rb_node, right) - offsetof(struct rb_node, left))))
+
+#define RB_U64_KEY(NODE) rb_entry(NODE, struct rb_u64_node, rb_node)->key
+
+/*
+ * Return a new tree of uint64_t keys.
+ */
+struct rb_tree rb_u64_tree_init(void);
+
+/*
+ * Return a new node with the given key. The node is not linked into any tree.
+ */
+struct rb_u64_node rb_u64_node_init(uint64_t key);
+
+/*
+ * Insert a node into the tree and return it. If a node with the same key is
+ * already in the tree, then return NULL and leave the tree unchanged.
+ */
+static inline struct rb_u64_node *
+rb_u64_insert(struct rb_tree *tree, struct rb_u64_node *node) {
+    uint64_t key = node->key;
+    struct rb_node *parent = NULL;
+    struct rb_node **link = &tree->root;
+    while (*link) {
+        parent = *link;
+        uint64_t curr = RB_U64_KEY(parent);
+        if (__builtin_expect(key == curr, 0)) {
+            return NULL;
+        }
+
+        link = RB_U64_CHILD(parent, key > curr);
+    }
+
+    rb_link_node(&node->rb_node, parent, link);
+    rb_insert_color(tree, &node->rb_node);
+    return node;
+}
+
+/*
+ * Return the node with the given key, or NULL if there is none.
+ */
+static inline struct rb_u64_node *
+rb_u64_search(struct rb_tree *tree, uint64_t key) {
+    struct rb_node *curr = tree->root;
+    while (curr) {
+        uint64_t curr_key = RB_U64_KEY(curr);
+        if (__builtin_expect(key == curr_key, 0)) {
+            return rb_entry(curr, struct rb_u64_node, rb_node);
+        }
+
+        curr = *RB_U64_CHILD(curr, key > curr_key);
+    }
+
+    return NULL;
+}
+
+/*
+ * Return the node with the least key greater than or equal to the given one,
+ * or NULL if there is none.
+ */
+static inline struct rb_u64_node *
+rb_u64_lower_bound(struct rb_tree *tree, uint64_t key) {
+    struct rb_node *curr = tree->root;
+    struct rb_node *bound = NULL;
+    while (curr) {
+        uint64_t curr_key = RB_U64_KEY(curr);
+        int right = key > curr_key;
+
+        // Remember the node whenever the descent goes left of it.
+        bound = right ? bound : curr;
+        curr = *RB_U64_CHILD(curr, right);
+    }
+
+    return bound ? rb_entry(bound, struct rb_u64_node, rb_node) : NULL;
+}
+
+/*
+ * Remove the node with the given key and return it, or return NULL if there
+ * is none.
+ */
+static inline struct rb_u64_node *
+rb_u64_remove(struct rb_tree *tree, uint64_t key) {
+    struct rb_u64_node *node = rb_u64_search(tree, key);
+    if (node) {
+        rb_erase(tree, &node->rb_node);
+    }
+
+    return node;
+}
+
+#endif
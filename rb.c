@@ -1,14 +1,16 @@
 #include "rb.h"
+#include <pthread.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdlib.h>
+#include <string.h>
 
 #define RB_RED 0
 #define RB_BLACK 1
 
 #define COLOR_OF(NODE) ((uintptr_t) (NODE)->parent & 1)
-#define IS_RED(NODE) (COLOR_OF(NODE) == RB_RED)
-#define IS_BLACK(NODE) (COLOR_OF(NODE) == RB_BLACK)
+#define IS_RED(NODE) ((NODE) && COLOR_OF(NODE) == RB_RED)
+#define IS_BLACK(NODE) (!(NODE) || COLOR_OF(NODE) == RB_BLACK)
 #define PARENT_OF(NODE) ((struct rb_node *) ((uintptr_t) ((NODE)->parent) & ~3))
 #define SET_PARENT(NODE, PARENT)                                                                                       \
     do {                                                                                                               \
@@ -19,26 +21,74 @@
         (NODE)->parent = ((NODE)->parent & ~1) | (uintptr_t) (COLOR);                                                  \
     } while (0);
 
-#define NIL (&nil)
+/*
+ * Insertion and removal store child and root links with relaxed atomic stores,
+ * as Linux does with WRITE_ONCE(), so that the lock-free readers of rb_latch
+ * can load them while a writer rebalances. These compile to plain stores.
+ */
+#define WRITE_LINK(FIELD, VALUE) __atomic_store_n(&(FIELD), (VALUE), __ATOMIC_RELAXED)
+
+/*
+ * Leaves, and the parent of the root, are NULL rather than a shared sentinel
+ * node. Nothing outside of a tree's own nodes is ever written, so operations on
+ * different trees never touch the same memory.
+ */
+
+/*
+ * Rebalancing is written once, in functions that take the tree's augmentation
+ * callbacks as an argument and are always inlined. Each public entry point
+ * checks for augmentation once and calls them with either the callbacks or a
+ * constant NULL, so the instance used for plain trees contains no augmentation
+ * code at all.
+ */
+#define RB_INLINE static inline __attribute__((always_inline))
 
-static struct rb_node nil = {(uintptr_t) NIL, NIL, NIL};
+/*
+ * With RB_STATS defined, every comparison, rotation, and rebalancing case is
+ * counted in the tree's stats. Otherwise these compile to nothing.
+ */
+#ifdef RB_STATS
+#define CMP(TREE, LEFT, RIGHT) ((TREE)->stats.comparisons += 1, (TREE)->cmp((LEFT), (RIGHT)))
+#define STAT(TREE, FIELD) ((TREE)->stats.FIELD += 1)
+#define STAT_DEPTH(TREE, DEPTH)                                                                                        \
+    do {                                                                                                               \
+        if ((DEPTH) > (TREE)->stats.max_depth) {                                                                       \
+            (TREE)->stats.max_depth = (DEPTH);                                                                         \
+        }                                                                                                              \
+    } while (0)
+#else
+#define CMP(TREE, LEFT, RIGHT) ((TREE)->cmp((LEFT), (RIGHT)))
+#define STAT(TREE, FIELD) ((void) 0)
+#define STAT_DEPTH(TREE, DEPTH) ((void) (DEPTH))
+#endif
 
 struct rb_tree
 rb_tree_init(rb_cmp cmp) {
     struct rb_tree tree;
-    tree.root = NIL;
+    tree.root = NULL;
+    tree.first = NULL;
+    tree.last = NULL;
     tree.cmp = cmp;
-    SET_COLOR(tree.root, RB_BLACK);
+    tree.augment = NULL;
+#ifdef RB_STATS
+    tree.stats = (struct rb_stats) {0};
+#endif
+    return tree;
+}
+
+struct rb_tree
+rb_tree_init_augmented(rb_cmp cmp, const struct rb_augment *augment) {
+    struct rb_tree tree = rb_tree_init(cmp);
+    tree.augment = augment;
     return tree;
 }
 
 struct rb_node
 rb_node_init(void) {
     struct rb_node node;
-    SET_PARENT(&node, NIL);
-    node.left = NIL;
-    node.right = NIL;
-    SET_COLOR(&node, RB_RED);
+    node.parent = RB_UNLINKED;
+    node.left = NULL;
+    node.right = NULL;
     return node;
 }
 
@@ -46,67 +96,106 @@ rb_node_init(void) {
 // Insertion
 // -----------------------------------------------------------------------------
 
-static void rb_insert_fixup(struct rb_tree *tree, struct rb_node *node);
+RB_INLINE bool rb_insert_fixup(struct rb_tree *tree, struct rb_node *node, const struct rb_augment *augment);
 
 struct rb_node *
 rb_insert(struct rb_tree *tree, struct rb_node *node) {
-    // If the tree is empty, then the node becomes the root.
-    if (tree->root == NIL) {
-        SET_PARENT(node, NIL);
-        node->left = NIL;
-        node->right = NIL;
-        SET_COLOR(node, RB_BLACK);
-        tree->root = node;
-        return tree->root;
+    struct rb_node *parent = NULL;
+    struct rb_node **link = NULL;
+
+    // Cannot insert duplicate keys.
+    if (rb_find_slot(tree, node, &parent, &link)) {
+        return NULL;
     }
 
-    // Perform a normal BST insertion.
-    struct rb_node *child = tree->root;
-    struct rb_node *parent = child;
-    int result = 0;
-    while (child != NIL) {
-        parent = child;
-        result = tree->cmp(node, child);
+    rb_link_node(node, parent, link);
+
+    // Ensure all RBT properties hold.
+    rb_insert_color(tree, node);
+
+    return node;
+}
+
+struct rb_node *
+rb_find_slot(struct rb_tree *tree, struct rb_node *node, struct rb_node **parent, struct rb_node ***link) {
+    // Perform a normal BST descent, remembering the last link followed. If the
+    // tree is empty, then the node becomes the root.
+    *parent = NULL;
+    *link = &tree->root;
+    size_t depth = 0;
+    while (**link) {
+        struct rb_node *curr = **link;
+        int result = CMP(tree, node, curr);
+        depth += 1;
 
         if (result == 0) {
-            // Cannot insert duplicate keys.
-            return NULL;
-        } else if (result < 0) {
-            child = child->left;
-        } else {
-            child = child->right;
+            STAT_DEPTH(tree, depth);
+            return curr;
         }
+
+        *parent = curr;
+        *link = result < 0 ? &curr->left : &curr->right;
     }
 
-    // The value of the child is now NIL. Insert the node as a child of the parent.
-    if (result < 0) {
-        parent->left = node;
-    } else {
-        parent->right = node;
+    STAT_DEPTH(tree, depth);
+    return NULL;
+}
+
+void
+rb_link_node(struct rb_node *node, struct rb_node *parent, struct rb_node **link) {
+    node->parent = (uintptr_t) parent | RB_RED;
+    WRITE_LINK(node->left, NULL);
+    WRITE_LINK(node->right, NULL);
+    WRITE_LINK(*link, node);
+}
+
+RB_INLINE void
+rb_do_insert_color(struct rb_tree *tree, struct rb_node *node, const struct rb_augment *augment) {
+    // A new node is the left-most node only if it was linked as the left child
+    // of the previous left-most node, and likewise for the right-most node.
+    struct rb_node *parent = PARENT_OF(node);
+    if (!parent) {
+        tree->first = node;
+        tree->last = node;
+    } else if (parent == tree->first && node == parent->left) {
+        tree->first = node;
+    } else if (parent == tree->last && node == parent->right) {
+        tree->last = node;
     }
 
-    SET_PARENT(node, parent);
-    SET_COLOR(node, RB_RED);
-    node->left = NIL;
-    node->right = NIL;
+    if (augment) {
+        augment->propagate(node, NULL);
+    }
 
-    // Ensure all RBT properties hold.
-    rb_insert_fixup(tree, node);
+    rb_insert_fixup(tree, node, augment);
+}
 
-    return node;
+void
+rb_insert_color(struct rb_tree *tree, struct rb_node *node) {
+    if (tree->augment) {
+        rb_do_insert_color(tree, node, tree->augment);
+    } else {
+        rb_do_insert_color(tree, node, NULL);
+    }
 }
 
-static void rb_rotate_left(struct rb_tree *tree, struct rb_node *node);
-static void rb_rotate_right(struct rb_tree *tree, struct rb_node *node);
+RB_INLINE void rb_rotate_left(struct rb_tree *tree, struct rb_node *node, const struct rb_augment *augment);
+RB_INLINE void rb_rotate_right(struct rb_tree *tree, struct rb_node *node, const struct rb_augment *augment);
 
-static void
-rb_insert_fixup(struct rb_tree *tree, struct rb_node *node) {
+/*
+ * Restore the red-black properties after linking in a red node. Return true if
+ * the root ends up red before being made black, which is exactly when the
+ * black height of the tree grows.
+ */
+RB_INLINE bool
+rb_insert_fixup(struct rb_tree *tree, struct rb_node *node, const struct rb_augment *augment) {
     while (node != tree->root && IS_RED(PARENT_OF(node))) {
         if (PARENT_OF(node) == PARENT_OF(PARENT_OF(node))->left) {
             struct rb_node *uncle = PARENT_OF(PARENT_OF(node))->right;
 
             if (IS_RED(uncle)) {
                 // Case 1
+                STAT(tree, insert_cases[0]);
                 SET_COLOR(PARENT_OF(node), RB_BLACK);
                 SET_COLOR(uncle, RB_BLACK);
                 SET_COLOR(PARENT_OF(PARENT_OF(node)), RB_RED);
@@ -114,19 +203,22 @@ rb_insert_fixup(struct rb_tree *tree, struct rb_node *node) {
             } else {
                 if (node == PARENT_OF(node)->right) {
                     // Case 2
+                    STAT(tree, insert_cases[1]);
                     node = PARENT_OF(node);
-                    rb_rotate_left(tree, node);
+                    rb_rotate_left(tree, node, augment);
                 }
                 // Case 3
+                STAT(tree, insert_cases[2]);
                 SET_COLOR(PARENT_OF(node), RB_BLACK);
                 SET_COLOR(PARENT_OF(PARENT_OF(node)), RB_RED);
-                rb_rotate_right(tree, PARENT_OF(PARENT_OF(node)));
+                rb_rotate_right(tree, PARENT_OF(PARENT_OF(node)), augment);
             }
         } else {
             struct rb_node *uncle = PARENT_OF(PARENT_OF(node))->left;
 
             if (IS_RED(uncle)) {
                 // Case 1
+                STAT(tree, insert_cases[0]);
                 SET_COLOR(PARENT_OF(node), RB_BLACK);
                 SET_COLOR(uncle, RB_BLACK);
                 SET_COLOR(PARENT_OF(PARENT_OF(node)), RB_RED);
@@ -134,18 +226,67 @@ rb_insert_fixup(struct rb_tree *tree, struct rb_node *node) {
             } else {
                 if (node == PARENT_OF(node)->left) {
                     // Case 2
+                    STAT(tree, insert_cases[1]);
                     node = PARENT_OF(node);
-                    rb_rotate_right(tree, node);
+                    rb_rotate_right(tree, node, augment);
                 }
                 // Case 3
+                STAT(tree, insert_cases[2]);
                 SET_COLOR(PARENT_OF(node), RB_BLACK);
                 SET_COLOR(PARENT_OF(PARENT_OF(node)), RB_RED);
-                rb_rotate_left(tree, PARENT_OF(PARENT_OF(node)));
+                rb_rotate_left(tree, PARENT_OF(PARENT_OF(node)), augment);
             }
         }
     }
 
+    bool grew = IS_RED(tree->root);
     SET_COLOR(tree->root, RB_BLACK);
+    return grew;
+}
+
+// -----------------------------------------------------------------------------
+// Bulk construction
+// -----------------------------------------------------------------------------
+
+/*
+ * Link nodes[low, high) into a subtree below `parent` and return its root. The
+ * middle node becomes the root, so the sizes of any node's subtrees differ by
+ * at most one, every level but the deepest is full, and coloring the deepest
+ * level red (and everything else black) satisfies every property.
+ */
+static struct rb_node *
+rb_build_subtree(struct rb_node **nodes, size_t low, size_t high, struct rb_node *parent, unsigned depth,
+                 unsigned red_depth, const struct rb_augment *augment) {
+    if (low == high) {
+        return NULL;
+    }
+
+    size_t mid = low + (high - low) / 2;
+    struct rb_node *node = nodes[mid];
+    node->parent = (uintptr_t) parent | (depth == red_depth ? RB_RED : RB_BLACK);
+    node->left = rb_build_subtree(nodes, low, mid, node, depth + 1, red_depth, augment);
+    node->right = rb_build_subtree(nodes, mid + 1, high, node, depth + 1, red_depth, augment);
+
+    // The children are done, so only this node needs to be computed.
+    if (augment) {
+        augment->propagate(node, parent);
+    }
+
+    return node;
+}
+
+void
+rb_build_sorted(struct rb_tree *tree, struct rb_node **nodes, size_t n) {
+    // The levels above the deepest are full, and hold 2^d - 1 nodes, where d
+    // is the depth of the deepest level.
+    unsigned red_depth = 0;
+    while (((size_t) 2 << red_depth) - 1 <= n) {
+        red_depth += 1;
+    }
+
+    tree->root = rb_build_subtree(nodes, 0, n, NULL, 0, red_depth, tree->augment);
+    tree->first = n ? nodes[0] : NULL;
+    tree->last = n ? nodes[n - 1] : NULL;
 }
 
 // -----------------------------------------------------------------------------
@@ -156,10 +297,13 @@ struct rb_node *
 rb_search(struct rb_tree *tree, struct rb_node *node) {
     struct rb_node *curr = tree->root;
     int result = 0;
-    while (curr != NIL) {
-        result = tree->cmp(node, curr);
+    size_t depth = 0;
+    while (curr) {
+        result = CMP(tree, node, curr);
+        depth += 1;
 
         if (result == 0) {
+            STAT_DEPTH(tree, depth);
             return curr;
         } else if (result < 0) {
             curr = curr->left;
@@ -169,32 +313,183 @@ rb_search(struct rb_tree *tree, struct rb_node *node) {
     }
 
     // No node was found with the given key.
+    STAT_DEPTH(tree, depth);
     return NULL;
 }
 
+void
+rb_search_batch(struct rb_tree *tree, struct rb_node **keys, size_t n, struct rb_node **out) {
+    struct rb_node *root = tree->root;
+    if (!root) {
+        for (size_t i = 0; i < n; i += 1) {
+            out[i] = NULL;
+        }
+
+        return;
+    }
+
+    // Each slot holds a descent in flight: the key it is for, and the node it
+    // compares against next, which has already been prefetched. A finished slot
+    // takes on the next key straight away rather than waiting for the others.
+    struct rb_node *curr[RB_BATCH];
+    size_t index[RB_BATCH];
+    size_t slots = 0;
+    size_t next = 0;
+
+    while (slots < RB_BATCH && next < n) {
+        curr[slots] = root;
+        index[slots] = next;
+        slots += 1;
+        next += 1;
+    }
+
+    while (slots > 0) {
+        for (size_t j = 0; j < slots;) {
+            struct rb_node *node = curr[j];
+            int result = CMP(tree, keys[index[j]], node);
+
+            if (result != 0) {
+                node = result < 0 ? node->left : node->right;
+                if (node) {
+                    __builtin_prefetch(node);
+                    curr[j] = node;
+                    j += 1;
+                    continue;
+                }
+            }
+
+            out[index[j]] = node;
+
+            if (next < n) {
+                curr[j] = root;
+                index[j] = next;
+                next += 1;
+                j += 1;
+            } else {
+                // Fill the hole with the last slot, which is visited next.
+                slots -= 1;
+                curr[j] = curr[slots];
+                index[j] = index[slots];
+            }
+        }
+    }
+}
+
+/*
+ * Return the left-most node that is greater than the given node, or greater
+ * than or equal to it if `inclusive` is true.
+ */
+static struct rb_node *
+rb_bound_above(struct rb_tree *tree, struct rb_node *node, bool inclusive) {
+    struct rb_node *bound = NULL;
+    struct rb_node *curr = tree->root;
+    while (curr) {
+        int result = CMP(tree, node, curr);
+
+        if (result < 0 || (result == 0 && inclusive)) {
+            // This node qualifies, but there may be a smaller one on the left.
+            bound = curr;
+            curr = curr->left;
+        } else {
+            curr = curr->right;
+        }
+    }
+
+    return bound;
+}
+
+/*
+ * Return the right-most node that is less than the given node, or less than or
+ * equal to it if `inclusive` is true.
+ */
+static struct rb_node *
+rb_bound_below(struct rb_tree *tree, struct rb_node *node, bool inclusive) {
+    struct rb_node *bound = NULL;
+    struct rb_node *curr = tree->root;
+    while (curr) {
+        int result = CMP(tree, node, curr);
+
+        if (result > 0 || (result == 0 && inclusive)) {
+            // This node qualifies, but there may be a greater one on the right.
+            bound = curr;
+            curr = curr->right;
+        } else {
+            curr = curr->left;
+        }
+    }
+
+    return bound;
+}
+
+struct rb_node *
+rb_lower_bound(struct rb_tree *tree, struct rb_node *node) {
+    return rb_bound_above(tree, node, true);
+}
+
+struct rb_node *
+rb_upper_bound(struct rb_tree *tree, struct rb_node *node) {
+    return rb_bound_above(tree, node, false);
+}
+
+struct rb_node *
+rb_floor(struct rb_tree *tree, struct rb_node *node) {
+    return rb_bound_below(tree, node, true);
+}
+
+struct rb_node *
+rb_ceil(struct rb_tree *tree, struct rb_node *node) {
+    return rb_bound_above(tree, node, true);
+}
+
 // -----------------------------------------------------------------------------
 // Removal
 // -----------------------------------------------------------------------------
 
 static void rb_transplant(struct rb_tree *tree, struct rb_node *u, struct rb_node *v);
-static void rb_remove_fixup(struct rb_tree *tree, struct rb_node *x);
+RB_INLINE void rb_remove_fixup(struct rb_tree *tree, struct rb_node *node, struct rb_node *parent,
+                               const struct rb_augment *augment);
 
 struct rb_node *
 rb_remove(struct rb_tree *tree, struct rb_node *node) {
-    if (!rb_search(tree, node)) {
+    // An equal node that isn't this one must not be unlinked in its place.
+    if (rb_search(tree, node) != node) {
         return NULL;
     }
 
+    rb_erase(tree, node);
+    return node;
+}
+
+RB_INLINE void
+rb_do_erase(struct rb_tree *tree, struct rb_node *node, const struct rb_augment *augment) {
+    // Since leaves are NULL, the child that replaces the removed node may be
+    // NULL too, so its parent is tracked separately for rb_remove_fixup().
     struct rb_node *child = NULL;
-    int color = COLOR_OF(node); // Should this be a different type?
+    struct rb_node *parent = NULL;
+    int color = COLOR_OF(node);
 
-    if (node->left == NIL) {
+    // The lowest node whose subtree lost the removed node, for augmentation.
+    struct rb_node *changed = NULL;
+
+    if (node == tree->first) {
+        tree->first = rb_next(node);
+    }
+
+    if (node == tree->last) {
+        tree->last = rb_prev(node);
+    }
+
+    if (!node->left) {
         // Only a right child.
         child = node->right;
+        parent = PARENT_OF(node);
+        changed = parent;
         rb_transplant(tree, node, node->right);
-    } else if (node->right == NIL) {
+    } else if (!node->right) {
         // Only a left child.
         child = node->left;
+        parent = PARENT_OF(node);
+        changed = parent;
         rb_transplant(tree, node, node->left);
     } else {
         // Two children.
@@ -203,91 +498,1007 @@ rb_remove(struct rb_tree *tree, struct rb_node *node) {
         child = next->right;
 
         if (PARENT_OF(next) == node) {
-            SET_PARENT(child, next)
+            parent = next;
         } else {
+            parent = PARENT_OF(next);
             rb_transplant(tree, next, next->right);
-            next->right = node->right;
+            WRITE_LINK(next->right, node->right);
             SET_PARENT(next->right, next);
         }
 
         rb_transplant(tree, node, next);
-        next->left = node->left;
+        WRITE_LINK(next->left, node->left);
         SET_PARENT(next->left, next);
         SET_COLOR(next, COLOR_OF(node));
+
+        if (augment) {
+            // The successor takes over the node's value, which its ancestors
+            // were computed from, and everything below it is brought up to
+            // date before it is.
+            augment->copy(node, next);
+            if (parent != next) {
+                augment->propagate(parent, next);
+            }
+        }
+
+        changed = next;
+    }
+
+    if (augment && changed) {
+        augment->propagate(changed, NULL);
     }
 
     if (color == RB_BLACK) {
-        rb_remove_fixup(tree, child);
+        rb_remove_fixup(tree, child, parent, augment);
     }
 
-    return node;
+    node->parent = RB_UNLINKED;
 }
 
-static void
-rb_remove_fixup(struct rb_tree *tree, struct rb_node *node) {
+void
+rb_erase(struct rb_tree *tree, struct rb_node *node) {
+    if (tree->augment) {
+        rb_do_erase(tree, node, tree->augment);
+    } else {
+        rb_do_erase(tree, node, NULL);
+    }
+}
+
+struct rb_node *
+rb_pop_first(struct rb_tree *tree) {
+    struct rb_node *first = tree->first;
+    if (first) {
+        rb_erase(tree, first);
+    }
+
+    return first;
+}
+
+struct rb_node *
+rb_pop_last(struct rb_tree *tree) {
+    struct rb_node *last = tree->last;
+    if (last) {
+        rb_erase(tree, last);
+    }
+
+    return last;
+}
+
+RB_INLINE void
+rb_remove_fixup(struct rb_tree *tree, struct rb_node *node, struct rb_node *parent, const struct rb_augment *augment) {
     struct rb_node *sibling = NULL;
 
+    // The node may be NULL, so its parent is passed in and kept up to date
+    // rather than read from the node.
     while (IS_BLACK(node) && node != tree->root) {
-        if (node == PARENT_OF(node)->left) {
-            sibling = PARENT_OF(node)->right;
+        if (node == parent->left) {
+            sibling = parent->right;
 
             if (IS_RED(sibling)) {
+                // Case 1
+                STAT(tree, remove_cases[0]);
                 SET_COLOR(sibling, RB_BLACK);
-                SET_COLOR(PARENT_OF(node), RB_RED);
-                rb_rotate_left(tree, PARENT_OF(node));
-                sibling = PARENT_OF(node)->right;
+                SET_COLOR(parent, RB_RED);
+                rb_rotate_left(tree, parent, augment);
+                sibling = parent->right;
             }
 
             if (IS_BLACK(sibling->left) && IS_BLACK(sibling->right)) {
+                // Case 2
+                STAT(tree, remove_cases[1]);
                 SET_COLOR(sibling, RB_RED);
-                node = PARENT_OF(node);
+                node = parent;
+                parent = PARENT_OF(node);
             } else {
                 if (IS_BLACK(sibling->right)) {
+                    // Case 3
+                    STAT(tree, remove_cases[2]);
                     SET_COLOR(sibling->left, RB_BLACK);
                     SET_COLOR(sibling, RB_RED);
-                    rb_rotate_right(tree, sibling);
-                    sibling = PARENT_OF(node)->right;
+                    rb_rotate_right(tree, sibling, augment);
+                    sibling = parent->right;
                 }
 
-                SET_COLOR(sibling, COLOR_OF(PARENT_OF(node)));
-                SET_COLOR(PARENT_OF(node), RB_BLACK);
+                // Case 4
+                STAT(tree, remove_cases[3]);
+                SET_COLOR(sibling, COLOR_OF(parent));
+                SET_COLOR(parent, RB_BLACK);
                 SET_COLOR(sibling->right, RB_BLACK);
-                rb_rotate_left(tree, PARENT_OF(node));
+                rb_rotate_left(tree, parent, augment);
                 node = tree->root;
             }
         } else {
-            sibling = PARENT_OF(node)->left;
+            sibling = parent->left;
 
             if (IS_RED(sibling)) {
+                // Case 1
+                STAT(tree, remove_cases[0]);
                 SET_COLOR(sibling, RB_BLACK);
-                SET_COLOR(PARENT_OF(node), RB_RED);
-                rb_rotate_right(tree, PARENT_OF(node));
-                sibling = PARENT_OF(node)->left;
+                SET_COLOR(parent, RB_RED);
+                rb_rotate_right(tree, parent, augment);
+                sibling = parent->left;
             }
 
             if (IS_BLACK(sibling->right) && IS_BLACK(sibling->left)) {
+                // Case 2
+                STAT(tree, remove_cases[1]);
                 SET_COLOR(sibling, RB_RED);
-                node = PARENT_OF(node);
+                node = parent;
+                parent = PARENT_OF(node);
             } else {
                 if (IS_BLACK(sibling->left)) {
+                    // Case 3
+                    STAT(tree, remove_cases[2]);
                     SET_COLOR(sibling->right, RB_BLACK);
                     SET_COLOR(sibling, RB_RED);
-                    rb_rotate_left(tree, sibling);
-                    sibling = PARENT_OF(node)->left;
+                    rb_rotate_left(tree, sibling, augment);
+                    sibling = parent->left;
                 }
 
-                SET_COLOR(sibling, COLOR_OF(PARENT_OF(node)));
-                SET_COLOR(PARENT_OF(node), RB_BLACK);
+                // Case 4
+                STAT(tree, remove_cases[3]);
+                SET_COLOR(sibling, COLOR_OF(parent));
+                SET_COLOR(parent, RB_BLACK);
                 SET_COLOR(sibling->left, RB_BLACK);
-                rb_rotate_right(tree, PARENT_OF(node));
+                rb_rotate_right(tree, parent, augment);
                 node = tree->root;
             }
         }
     }
 
-    SET_COLOR(node, RB_BLACK);
+    if (node) {
+        SET_COLOR(node, RB_BLACK);
+    }
 }
 
+// -----------------------------------------------------------------------------
+// Cursors
+// -----------------------------------------------------------------------------
+
+/*
+ * The cursor functions below are written once for both directions. Going
+ * forwards, a step descends into the right subtree and then as far left as it
+ * can, and going backwards, the mirror image.
+ */
+
+/*
+ * Push the path from a node down to the last node of its subtree in the
+ * direction of travel, and return that node.
+ */
+RB_INLINE struct rb_node *
+rb_cursor_descend(struct rb_cursor *cursor, struct rb_node *node, bool reverse) {
+    while (true) {
+        cursor->path[cursor->depth] = node;
+        cursor->depth += 1;
+
+        struct rb_node *child = reverse ? node->right : node->left;
+        if (!child) {
+            break;
+        }
+
+        node = child;
+    }
+
+    // The next step descends into the far subtree, if there is one.
+    __builtin_prefetch(reverse ? node->left : node->right);
+    return node;
+}
+
+RB_INLINE struct rb_node *
+rb_cursor_step(struct rb_cursor *cursor, bool reverse) {
+    if (cursor->depth == 0) {
+        return NULL;
+    }
+
+    struct rb_node *node = cursor->path[cursor->depth - 1];
+    struct rb_node *child = reverse ? node->left : node->right;
+    if (child) {
+        return rb_cursor_descend(cursor, child, reverse);
+    }
+
+    // Climb until arriving from the near side. That ancestor comes next.
+    do {
+        cursor->depth -= 1;
+        if (cursor->depth == 0) {
+            return NULL;
+        }
+
+        child = node;
+        node = cursor->path[cursor->depth - 1];
+    } while (child == (reverse ? node->left : node->right));
+
+    __builtin_prefetch(reverse ? node->left : node->right);
+    return node;
+}
+
+struct rb_node *
+rb_cursor_first(struct rb_cursor *cursor, struct rb_tree *tree) {
+    cursor->depth = 0;
+    return tree->root ? rb_cursor_descend(cursor, tree->root, false) : NULL;
+}
+
+struct rb_node *
+rb_cursor_last(struct rb_cursor *cursor, struct rb_tree *tree) {
+    cursor->depth = 0;
+    return tree->root ? rb_cursor_descend(cursor, tree->root, true) : NULL;
+}
+
+struct rb_node *
+rb_cursor_seek(struct rb_cursor *cursor, struct rb_tree *tree, struct rb_node *node) {
+    // The bound is the last node the descent went left from, or stopped at,
+    // and the path to it is a prefix of the path taken.
+    size_t bound = 0;
+    cursor->depth = 0;
+
+    struct rb_node *curr = tree->root;
+    while (curr) {
+        cursor->path[cursor->depth] = curr;
+        cursor->depth += 1;
+
+        int result = CMP(tree, node, curr);
+        if (result <= 0) {
+            bound = cursor->depth;
+            if (result == 0) {
+                break;
+            }
+        }
+
+        curr = result < 0 ? curr->left : curr->right;
+    }
+
+    cursor->depth = bound;
+    return rb_cursor_get(cursor);
+}
+
+struct rb_node *
+rb_cursor_next(struct rb_cursor *cursor) {
+    return rb_cursor_step(cursor, false);
+}
+
+struct rb_node *
+rb_cursor_prev(struct rb_cursor *cursor) {
+    return rb_cursor_step(cursor, true);
+}
+
+// -----------------------------------------------------------------------------
+// Join and split
+// -----------------------------------------------------------------------------
+
+/*
+ * Return the number of black nodes on any path from a node down to a leaf,
+ * counting the node itself.
+ */
+static unsigned
+rb_black_depth(struct rb_node *node) {
+    unsigned black_depth = 0;
+    for (; node; node = node->left) {
+        if (IS_BLACK(node)) {
+            black_depth += 1;
+        }
+    }
+
+    return black_depth;
+}
+
+/*
+ * Detach a subtree from its parent and return its root, which is made black so
+ * that the subtree is a valid tree of its own.
+ */
+static struct rb_node *
+rb_detach(struct rb_node *node) {
+    if (node) {
+        node->parent = (uintptr_t) NULL | RB_BLACK;
+    }
+
+    return node;
+}
+
+/*
+ * Join two trees, given by their black roots and black depths, with a pivot
+ * that is greater than every node in `left` and less than every node in
+ * `right`. Return the root of the joined tree, and store its black depth in
+ * `depth_out`. This takes O(|h(left) - h(right)| + 1) time.
+ */
+static struct rb_node *
+rb_join_roots(struct rb_node *left, unsigned left_depth, struct rb_node *pivot, struct rb_node *right,
+              unsigned right_depth, const struct rb_augment *augment, unsigned *depth_out) {
+    if (left_depth == right_depth) {
+        // The pivot becomes a black root over both trees.
+        pivot->parent = (uintptr_t) NULL | RB_BLACK;
+        pivot->left = left;
+        pivot->right = right;
+    } else {
+        // Walk down the inner spine of the taller tree to the first black node
+        // with the same black depth as the shorter tree, and put the pivot in
+        // its place as a red node, with the shorter tree on its other side.
+        bool left_taller = left_depth > right_depth;
+        struct rb_node *parent = NULL;
+        struct rb_node *curr = left_taller ? left : right;
+        unsigned depth = left_taller ? left_depth : right_depth;
+        unsigned target = left_taller ? right_depth : left_depth;
+
+        while (!IS_BLACK(curr) || depth != target) {
+            if (IS_BLACK(curr)) {
+                depth -= 1;
+            }
+
+            parent = curr;
+            curr = left_taller ? curr->right : curr->left;
+        }
+
+        pivot->parent = (uintptr_t) parent | RB_RED;
+        if (left_taller) {
+            pivot->left = curr;
+            pivot->right = right;
+            parent->right = pivot;
+        } else {
+            pivot->left = left;
+            pivot->right = curr;
+            parent->left = pivot;
+        }
+    }
+
+    if (pivot->left) {
+        SET_PARENT(pivot->left, pivot);
+    }
+
+    if (pivot->right) {
+        SET_PARENT(pivot->right, pivot);
+    }
+
+    if (augment) {
+        augment->propagate(pivot, NULL);
+    }
+
+    // The pivot may be a red child of a red node, which is fixed up just like
+    // after an insertion.
+    // If that pushes a red node up to the root, making it black adds a level.
+    struct rb_tree tree = rb_tree_init(NULL);
+    tree.root = PARENT_OF(pivot) ? (left_depth > right_depth ? left : right) : pivot;
+    bool grew = rb_insert_fixup(&tree, pivot, augment);
+    if (left_depth == right_depth) {
+        *depth_out = left_depth + 1;
+    } else {
+        *depth_out = (left_depth > right_depth ? left_depth : right_depth) + grew;
+    }
+
+    return tree.root;
+}
+
+/*
+ * Return the black depth of a child of a black node with the given black
+ * depth, once the child is detached and so made black.
+ */
+static inline unsigned
+rb_child_depth(struct rb_node *child, unsigned depth) {
+    return depth - 1 + IS_RED(child);
+}
+
+void
+rb_join(struct rb_tree *left, struct rb_node *pivot, struct rb_tree *right) {
+    struct rb_node *first = left->first ? left->first : pivot;
+    struct rb_node *last = right->last ? right->last : pivot;
+
+    unsigned depth = 0;
+    left->root = rb_join_roots(left->root, rb_black_depth(left->root), pivot, right->root, rb_black_depth(right->root),
+                               left->augment, &depth);
+    left->first = first;
+    left->last = last;
+
+    right->root = NULL;
+    right->first = NULL;
+    right->last = NULL;
+}
+
+/*
+ * Split the subtree rooted at `node`, a black root with the given black depth,
+ * into the nodes less than `key`, whose root and black depth are stored in
+ * `low` and `low_depth`, and the rest, stored in `high` and `high_depth`. Each
+ * node on the search path is used as the pivot to join the pieces on either
+ * side of it. The black depths are tracked on the way down rather than walked
+ * again, so each join costs the difference in depth of its pieces, and those
+ * costs add up to O(log n).
+ *
+ * If `equal` is not NULL, then a node equal to the key is left out of both
+ * halves and stored in it instead. It must be initialized to NULL.
+ */
+static void
+rb_split_subtree(struct rb_tree *tree, struct rb_node *node, unsigned depth, struct rb_node *key,
+                 struct rb_node **low, unsigned *low_depth, struct rb_node **equal, struct rb_node **high,
+                 unsigned *high_depth) {
+    if (!node) {
+        *low = NULL;
+        *low_depth = 0;
+        *high = NULL;
+        *high_depth = 0;
+        return;
+    }
+
+    unsigned left_depth = rb_child_depth(node->left, depth);
+    unsigned right_depth = rb_child_depth(node->right, depth);
+    struct rb_node *left = rb_detach(node->left);
+    struct rb_node *right = rb_detach(node->right);
+    int result = CMP(tree, key, node);
+
+    if (result == 0 && equal) {
+        *low = left;
+        *low_depth = left_depth;
+        *equal = node;
+        *high = right;
+        *high_depth = right_depth;
+    } else if (result <= 0) {
+        // The node and everything to its right are not less than the key.
+        struct rb_node *middle = NULL;
+        unsigned middle_depth = 0;
+        rb_split_subtree(tree, left, left_depth, key, low, low_depth, equal, &middle, &middle_depth);
+        *high = rb_join_roots(middle, middle_depth, node, right, right_depth, tree->augment, high_depth);
+    } else {
+        struct rb_node *middle = NULL;
+        unsigned middle_depth = 0;
+        rb_split_subtree(tree, right, right_depth, key, &middle, &middle_depth, equal, high, high_depth);
+        *low = rb_join_roots(left, left_depth, node, middle, middle_depth, tree->augment, low_depth);
+    }
+}
+
+void
+rb_split(struct rb_tree *tree, struct rb_node *key, struct rb_tree *low, struct rb_tree *high) {
+    struct rb_tree whole = *tree;
+
+    tree->root = NULL;
+    tree->first = NULL;
+    tree->last = NULL;
+
+    *low = rb_tree_init_augmented(whole.cmp, whole.augment);
+    *high = rb_tree_init_augmented(whole.cmp, whole.augment);
+
+    struct rb_node *low_root = NULL;
+    struct rb_node *high_root = NULL;
+    unsigned low_depth = 0;
+    unsigned high_depth = 0;
+    rb_split_subtree(&whole, rb_detach(whole.root), rb_black_depth(whole.root), key, &low_root, &low_depth, NULL,
+                     &high_root, &high_depth);
+
+    // The outer ends of the halves are those of the whole tree.
+    low->root = low_root;
+    low->first = low_root ? whole.first : NULL;
+    low->last = rb_last(low_root);
+
+    high->root = high_root;
+    high->first = rb_first(high_root);
+    high->last = high_root ? whole.last : NULL;
+
+#ifdef RB_STATS
+    rb_stats_add(&low->stats, &whole.stats);
+#endif
+}
+
+// -----------------------------------------------------------------------------
+// Set operations
+// -----------------------------------------------------------------------------
+
+/*
+ * The set operations split one tree at the root of the other, recurse on the
+ * two sides independently, and join the results. Near the top of the
+ * recursion, the left side is handed to a new thread while the current thread
+ * works on the right side, so that about `threads` threads are busy at once.
+ * Below that, each thread recurses on its own.
+ */
+
+enum rb_set_op {
+    RB_UNION,
+    RB_INTERSECT,
+    RB_DIFFERENCE,
+};
+
+struct rb_set_task {
+    struct rb_tree *tree;
+    enum rb_set_op op;
+    struct rb_node *a;
+    unsigned a_depth;
+    struct rb_node *b;
+    unsigned b_depth;
+    unsigned threads;
+    struct rb_node *result;
+    unsigned result_depth;
+};
+
+/*
+ * Mark every node in a subtree as unlinked.
+ */
+static void
+rb_drop(struct rb_node *node) {
+    while (node) {
+        rb_drop(node->left);
+        struct rb_node *right = node->right;
+        node->parent = RB_UNLINKED;
+        node = right;
+    }
+}
+
+/*
+ * Remove the right-most node from a subtree, given by its black root and black
+ * depth, and store it in `last`. Return the root of what is left, and store its
+ * black depth in `depth_out`.
+ */
+static struct rb_node *
+rb_split_last(struct rb_node *node, unsigned depth, struct rb_node **last, const struct rb_augment *augment,
+              unsigned *depth_out) {
+    unsigned left_depth = rb_child_depth(node->left, depth);
+    unsigned right_depth = rb_child_depth(node->right, depth);
+    struct rb_node *left = rb_detach(node->left);
+    struct rb_node *right = rb_detach(node->right);
+
+    if (!right) {
+        *last = node;
+        *depth_out = left_depth;
+        return left;
+    }
+
+    unsigned rest_depth = 0;
+    struct rb_node *rest = rb_split_last(right, right_depth, last, augment, &rest_depth);
+    return rb_join_roots(left, left_depth, node, rest, rest_depth, augment, depth_out);
+}
+
+/*
+ * Join two subtrees, given by their black roots and black depths, without a
+ * pivot. Every node in `left` must be less than every node in `right`. Return
+ * the root of the result, and store its black depth in `depth_out`.
+ */
+static struct rb_node *
+rb_join_all(struct rb_node *left, unsigned left_depth, struct rb_node *right, unsigned right_depth,
+            const struct rb_augment *augment, unsigned *depth_out) {
+    if (!left) {
+        *depth_out = right_depth;
+        return right;
+    }
+
+    unsigned rest_depth = 0;
+    struct rb_node *pivot = NULL;
+    struct rb_node *rest = rb_split_last(left, left_depth, &pivot, augment, &rest_depth);
+    return rb_join_roots(rest, rest_depth, pivot, right, right_depth, augment, depth_out);
+}
+
+static struct rb_node *rb_set_subtree(struct rb_tree *tree, enum rb_set_op op, struct rb_node *a, unsigned a_depth,
+                                      struct rb_node *b, unsigned b_depth, unsigned threads, unsigned *depth_out);
+
+static void *
+rb_set_thread(void *arg) {
+    struct rb_set_task *task = arg;
+    task->result = rb_set_subtree(task->tree, task->op, task->a, task->a_depth, task->b, task->b_depth,
+                                  task->threads, &task->result_depth);
+    return NULL;
+}
+
+/*
+ * Apply a set operation to two subtrees, given by their black roots and black
+ * depths, and return the root of the result, storing its black depth in
+ * `depth_out`. Nodes of `a` are kept in preference to equal nodes of `b`, and
+ * every node left out of the result is marked as unlinked.
+ *
+ * Black depths are passed down and back up rather than measured, so that each
+ * join costs only the difference in depth of its pieces.
+ */
+static struct rb_node *
+rb_set_subtree(struct rb_tree *tree, enum rb_set_op op, struct rb_node *a, unsigned a_depth, struct rb_node *b,
+               unsigned b_depth, unsigned threads, unsigned *depth_out) {
+    if (!a || !b) {
+        switch (op) {
+        case RB_UNION:
+            *depth_out = a ? a_depth : b_depth;
+            return a ? a : b;
+        case RB_INTERSECT:
+            rb_drop(a);
+            rb_drop(b);
+            *depth_out = 0;
+            return NULL;
+        case RB_DIFFERENCE:
+            rb_drop(b);
+            *depth_out = a_depth;
+            return a;
+        }
+    }
+
+    unsigned a_left_depth = rb_child_depth(a->left, a_depth);
+    unsigned a_right_depth = rb_child_depth(a->right, a_depth);
+    struct rb_node *a_left = rb_detach(a->left);
+    struct rb_node *a_right = rb_detach(a->right);
+
+    struct rb_node *b_left = NULL;
+    struct rb_node *equal = NULL;
+    struct rb_node *b_right = NULL;
+    unsigned b_left_depth = 0;
+    unsigned b_right_depth = 0;
+    rb_split_subtree(tree, b, b_depth, a, &b_left, &b_left_depth, &equal, &b_right, &b_right_depth);
+
+    // The left side works on a copy of the tree, so that a forked thread
+    // doesn't share anything it writes to.
+    struct rb_tree fork = *tree;
+#ifdef RB_STATS
+    fork.stats = (struct rb_stats) {0};
+#endif
+
+    unsigned left_threads = threads / 2;
+    unsigned right_threads = threads - left_threads;
+    struct rb_set_task left = {&fork, op, a_left, a_left_depth, b_left, b_left_depth, left_threads, NULL, 0};
+    struct rb_set_task right = {tree, op, a_right, a_right_depth, b_right, b_right_depth, right_threads, NULL, 0};
+
+    // Fork the left side if there are threads to spare and it's worth it.
+    pthread_t thread;
+    bool forked = threads > 1 && a_left && b_left && pthread_create(&thread, NULL, rb_set_thread, &left) == 0;
+    if (!forked) {
+        left.threads = 1;
+        rb_set_thread(&left);
+    }
+
+    rb_set_thread(&right);
+
+    if (forked) {
+        pthread_join(thread, NULL);
+    }
+
+#ifdef RB_STATS
+    rb_stats_add(&tree->stats, &fork.stats);
+#endif
+
+    if (equal) {
+        equal->parent = RB_UNLINKED;
+    }
+
+    // The root of `a` stays if it's in the result, and is the pivot if so.
+    bool keep = op == RB_UNION || (op == RB_INTERSECT) == (equal != NULL);
+    if (keep) {
+        return rb_join_roots(left.result, left.result_depth, a, right.result, right.result_depth, tree->augment,
+                             depth_out);
+    }
+
+    a->parent = RB_UNLINKED;
+    return rb_join_all(left.result, left.result_depth, right.result, right.result_depth, tree->augment, depth_out);
+}
+
+/*
+ * Apply a set operation to two trees, storing the result in `a` and leaving
+ * `b` empty.
+ */
+static void
+rb_set(struct rb_tree *a, struct rb_tree *b, enum rb_set_op op, unsigned threads) {
+    unsigned depth = 0;
+    unsigned a_depth = rb_black_depth(a->root);
+    unsigned b_depth = rb_black_depth(b->root);
+    struct rb_node *root =
+        rb_set_subtree(a, op, rb_detach(a->root), a_depth, rb_detach(b->root), b_depth, threads ? threads : 1, &depth);
+
+    a->root = root;
+    a->first = rb_first(root);
+    a->last = rb_last(root);
+
+    b->root = NULL;
+    b->first = NULL;
+    b->last = NULL;
+}
+
+void
+rb_union(struct rb_tree *a, struct rb_tree *b, unsigned threads) {
+    rb_set(a, b, RB_UNION, threads);
+}
+
+void
+rb_intersect(struct rb_tree *a, struct rb_tree *b, unsigned threads) {
+    rb_set(a, b, RB_INTERSECT, threads);
+}
+
+void
+rb_difference(struct rb_tree *a, struct rb_tree *b, unsigned threads) {
+    rb_set(a, b, RB_DIFFERENCE, threads);
+}
+
+// -----------------------------------------------------------------------------
+// Relayout
+// -----------------------------------------------------------------------------
+
+/*
+ * Elements are copied into the buffer in layout order, and as each one is
+ * copied, the parent field of its old node, which is no longer needed, is
+ * overwritten with the address of the new node. Once everything has been
+ * copied, the links in the new nodes still point to old nodes, and each is
+ * replaced by what was stashed in the old node it points to.
+ */
+
+struct rb_compact {
+    unsigned char *buffer;
+    size_t stride;
+    size_t offset;
+    size_t count;
+};
+
+/*
+ * Copy the element of a node to the end of the buffer, and return its new node.
+ */
+static struct rb_node *
+rb_compact_move(struct rb_compact *compact, struct rb_node *node) {
+    unsigned char *elem = compact->buffer + compact->count * compact->stride;
+    memcpy(elem, (unsigned char *) node - compact->offset, compact->stride);
+    compact->count += 1;
+
+    struct rb_node *moved = (struct rb_node *) (elem + compact->offset);
+    node->parent = (uintptr_t) moved;
+    return moved;
+}
+
+static unsigned
+rb_height(struct rb_node *node) {
+    if (!node) {
+        return 0;
+    }
+
+    unsigned left = rb_height(node->left);
+    unsigned right = rb_height(node->right);
+    return (left > right ? left : right) + 1;
+}
+
+static void rb_compact_veb(struct rb_compact *compact, struct rb_node *node, unsigned height);
+
+/*
+ * Lay out each subtree of the given height that hangs `depth` levels below the
+ * node, from left to right.
+ */
+static void
+rb_compact_veb_bottom(struct rb_compact *compact, struct rb_node *node, unsigned depth, unsigned height) {
+    if (!node) {
+        return;
+    }
+
+    if (depth == 0) {
+        rb_compact_veb(compact, node, height);
+        return;
+    }
+
+    rb_compact_veb_bottom(compact, node->left, depth - 1, height);
+    rb_compact_veb_bottom(compact, node->right, depth - 1, height);
+}
+
+/*
+ * Lay out the top `height` levels of the subtree rooted at a node, in van Emde
+ * Boas order. Only the old nodes' parent fields are overwritten, so their
+ * children can still be followed.
+ */
+static void
+rb_compact_veb(struct rb_compact *compact, struct rb_node *node, unsigned height) {
+    if (!node || height == 0) {
+        return;
+    }
+
+    if (height == 1) {
+        rb_compact_move(compact, node);
+        return;
+    }
+
+    unsigned top = height / 2;
+    rb_compact_veb(compact, node, top);
+    rb_compact_veb_bottom(compact, node, top, height - top);
+}
+
+/*
+ * Replace a link to an old node with the new node stashed in it.
+ */
+static inline struct rb_node *
+rb_compact_link(struct rb_node *node) {
+    return node ? (struct rb_node *) node->parent : NULL;
+}
+
+size_t
+rb_compact(struct rb_tree *tree, void *buffer, size_t stride, size_t offset, enum rb_layout layout) {
+    struct rb_compact compact = {buffer, stride, offset, 0};
+    if (!tree->root) {
+        return 0;
+    }
+
+    switch (layout) {
+    case RB_LAYOUT_BFS:
+        // The new nodes make up the queue, since they still link to the old
+        // children until they are fixed up.
+        rb_compact_move(&compact, tree->root);
+        for (size_t i = 0; i < compact.count; i += 1) {
+            struct rb_node *node = (struct rb_node *) (compact.buffer + i * stride + offset);
+            if (node->left) {
+                rb_compact_move(&compact, node->left);
+            }
+
+            if (node->right) {
+                rb_compact_move(&compact, node->right);
+            }
+        }
+        break;
+    case RB_LAYOUT_VEB:
+        rb_compact_veb(&compact, tree->root, rb_height(tree->root));
+        break;
+    }
+
+    for (size_t i = 0; i < compact.count; i += 1) {
+        struct rb_node *node = (struct rb_node *) (compact.buffer + i * stride + offset);
+        node->parent = (uintptr_t) rb_compact_link(PARENT_OF(node)) | COLOR_OF(node);
+        node->left = rb_compact_link(node->left);
+        node->right = rb_compact_link(node->right);
+    }
+
+    tree->root = rb_compact_link(tree->root);
+    tree->first = rb_compact_link(tree->first);
+    tree->last = rb_compact_link(tree->last);
+    return compact.count;
+}
+
+// -----------------------------------------------------------------------------
+// Order statistics
+// -----------------------------------------------------------------------------
+
+#define SIZE_OF(NODE) ((NODE) ? rb_entry(NODE, struct rb_sized_node, rb_node)->size : 0)
+
+static inline size_t
+rb_sized_compute(struct rb_sized_node *node) {
+    return SIZE_OF(node->rb_node.left) + SIZE_OF(node->rb_node.right) + 1;
+}
+
+RB_DECLARE_AUGMENT(rb_sized_augment, struct rb_sized_node, rb_node, size, rb_sized_compute);
+
+struct rb_tree
+rb_tree_init_sized(rb_cmp cmp) {
+    return rb_tree_init_augmented(cmp, &rb_sized_augment);
+}
+
+struct rb_node *
+rb_select(struct rb_tree *tree, size_t k) {
+    struct rb_node *curr = tree->root;
+    while (curr) {
+        size_t left = SIZE_OF(curr->left);
+
+        if (k == left) {
+            return curr;
+        } else if (k < left) {
+            curr = curr->left;
+        } else {
+            k -= left + 1;
+            curr = curr->right;
+        }
+    }
+
+    // There are no more than k nodes in the tree.
+    return NULL;
+}
+
+size_t
+rb_rank(struct rb_node *node) {
+    // Every node to the left of the path from the root is smaller.
+    size_t rank = SIZE_OF(node->left);
+    while (PARENT_OF(node)) {
+        if (node == PARENT_OF(node)->right) {
+            rank += SIZE_OF(PARENT_OF(node)->left) + 1;
+        }
+
+        node = PARENT_OF(node);
+    }
+
+    return rank;
+}
+
+/*
+ * Return the number of nodes less than the given node, or less than or equal to
+ * it if `inclusive` is true.
+ */
+static size_t
+rb_count_below(struct rb_tree *tree, struct rb_node *node, bool inclusive) {
+    size_t count = 0;
+    struct rb_node *curr = tree->root;
+    while (curr) {
+        int result = CMP(tree, node, curr);
+
+        if (result > 0 || (result == 0 && inclusive)) {
+            count += SIZE_OF(curr->left) + 1;
+            curr = curr->right;
+        } else {
+            curr = curr->left;
+        }
+    }
+
+    return count;
+}
+
+size_t
+rb_count_range(struct rb_tree *tree, struct rb_node *low, struct rb_node *high) {
+    size_t below_high = rb_count_below(tree, high, true);
+    size_t below_low = rb_count_below(tree, low, false);
+    return below_high > below_low ? below_high - below_low : 0;
+}
+
+// -----------------------------------------------------------------------------
+// Profiling
+// -----------------------------------------------------------------------------
+
+void
+rb_profile(struct rb_tree *tree, struct rb_report *report) {
+    *report = (struct rb_report) {0};
+    report->black_height = rb_black_depth(tree->root);
+
+    size_t total_depth = 0;
+    size_t links = 0;
+    size_t line_links = 0;
+    size_t page_links = 0;
+
+    // Walk the tree in pre-order without a stack, by remembering where each
+    // step came from: from above, the node is visited and then its left child
+    // is next; from the left, its right child is; and from the right, its
+    // parent is.
+    struct rb_node *prev = NULL;
+    struct rb_node *node = tree->root;
+    size_t depth = 1;
+    while (node) {
+        struct rb_node *parent = PARENT_OF(node);
+        struct rb_node *next = parent;
+
+        if (prev == parent) {
+            report->nodes += 1;
+            report->red += IS_RED(node);
+            report->depths[depth] += 1;
+            total_depth += depth;
+            if (depth > report->max_depth) {
+                report->max_depth = depth;
+            }
+
+            if (parent) {
+                uintptr_t from = (uintptr_t) parent;
+                uintptr_t to = (uintptr_t) node;
+                uintptr_t distance = from > to ? from - to : to - from;
+                links += 1;
+                line_links += distance < 64;
+                page_links += distance < 4096;
+            }
+
+            next = node->left ? node->left : node->right ? node->right : parent;
+        } else if (prev == node->left && node->right) {
+            next = node->right;
+        }
+
+        depth = next == parent ? depth - 1 : depth + 1;
+        prev = node;
+        node = next;
+    }
+
+    if (report->nodes) {
+        report->average_depth = (double) total_depth / (double) report->nodes;
+    }
+
+    if (links) {
+        report->line_local = (double) line_links / (double) links;
+        report->page_local = (double) page_links / (double) links;
+    }
+}
+
+#ifdef RB_STATS
+
+// -----------------------------------------------------------------------------
+// Statistics
+// -----------------------------------------------------------------------------
+
+void
+rb_stats_add(struct rb_stats *total, const struct rb_stats *stats) {
+    total->comparisons += stats->comparisons;
+    for (size_t i = 0; i < 2; i += 1) {
+        total->rotations[i] += stats->rotations[i];
+    }
+
+    for (size_t i = 0; i < 3; i += 1) {
+        total->insert_cases[i] += stats->insert_cases[i];
+    }
+
+    for (size_t i = 0; i < 4; i += 1) {
+        total->remove_cases[i] += stats->remove_cases[i];
+    }
+
+    if (stats->max_depth > total->max_depth) {
+        total->max_depth = stats->max_depth;
+    }
+}
+
+#endif
+
 // -----------------------------------------------------------------------------
 // Helpers
 // -----------------------------------------------------------------------------
@@ -295,57 +1506,67 @@ rb_remove_fixup(struct rb_tree *tree, struct rb_node *node) {
 /*
  * Rotate the node to the left.
  */
-static void
-rb_rotate_left(struct rb_tree *tree, struct rb_node *node) {
+RB_INLINE void
+rb_rotate_left(struct rb_tree *tree, struct rb_node *node, const struct rb_augment *augment) {
+    STAT(tree, rotations[0]);
     struct rb_node *child = node->right;
-    node->right = child->left;
+    WRITE_LINK(node->right, child->left);
 
-    if (child->left != NIL) {
+    if (child->left) {
         SET_PARENT(child->left, node);
     }
 
     SET_PARENT(child, PARENT_OF(node));
 
-    if (PARENT_OF(node) != NIL) {
+    if (PARENT_OF(node)) {
         if (node == PARENT_OF(node)->left) {
-            PARENT_OF(node)->left = child;
+            WRITE_LINK(PARENT_OF(node)->left, child);
         } else {
-            PARENT_OF(node)->right = child;
+            WRITE_LINK(PARENT_OF(node)->right, child);
         }
     } else {
-        tree->root = child;
+        WRITE_LINK(tree->root, child);
     }
 
-    child->left = node;
+    WRITE_LINK(child->left, node);
     SET_PARENT(node, child);
+
+    if (augment) {
+        augment->rotate(node, child);
+    }
 }
 
 /*
  * Rotate the node to the right.
  */
-static void
-rb_rotate_right(struct rb_tree *tree, struct rb_node *node) {
+RB_INLINE void
+rb_rotate_right(struct rb_tree *tree, struct rb_node *node, const struct rb_augment *augment) {
+    STAT(tree, rotations[1]);
     struct rb_node *child = node->left;
-    node->left = child->right;
+    WRITE_LINK(node->left, child->right);
 
-    if (child->right != NIL) {
+    if (child->right) {
         SET_PARENT(child->right, node);
     }
 
     SET_PARENT(child, PARENT_OF(node));
 
-    if (PARENT_OF(child) != NIL) {
+    if (PARENT_OF(child)) {
         if (node == PARENT_OF(node)->right) {
-            PARENT_OF(node)->right = child;
+            WRITE_LINK(PARENT_OF(node)->right, child);
         } else {
-            PARENT_OF(node)->left = child;
+            WRITE_LINK(PARENT_OF(node)->left, child);
         }
     } else {
-        tree->root = child;
+        WRITE_LINK(tree->root, child);
     }
 
-    child->right = node;
+    WRITE_LINK(child->right, node);
     SET_PARENT(node, child);
+
+    if (augment) {
+        augment->rotate(node, child);
+    }
 }
 
 /*
@@ -353,76 +1574,78 @@ rb_rotate_right(struct rb_tree *tree, struct rb_node *node) {
  */
 static void
 rb_transplant(struct rb_tree *tree, struct rb_node *u, struct rb_node *v) {
-    if (PARENT_OF(u) == NIL) {
-        tree->root = v;
+    if (!PARENT_OF(u)) {
+        WRITE_LINK(tree->root, v);
     } else if (u == PARENT_OF(u)->left) {
-        PARENT_OF(u)->left = v;
+        WRITE_LINK(PARENT_OF(u)->left, v);
     } else {
-        PARENT_OF(u)->right = v;
+        WRITE_LINK(PARENT_OF(u)->right, v);
     }
 
-    SET_PARENT(v, PARENT_OF(u));
+    if (v) {
+        SET_PARENT(v, PARENT_OF(u));
+    }
 }
 
 struct rb_node *
 rb_next(struct rb_node *node) {
-    if (node->right != NIL) {
+    if (node->right) {
         return rb_first(node->right);
     }
 
-    if (PARENT_OF(node) == NIL) {
-        return NULL;
-    }
-
     struct rb_node *parent = PARENT_OF(node);
-    while (parent != NIL && node == parent->right) {
+    while (parent && node == parent->right) {
         node = parent;
         parent = PARENT_OF(parent);
     }
 
-    return parent == NIL ? NULL : parent;
+    return parent;
 }
 
 struct rb_node *
 rb_prev(struct rb_node *node) {
-    if (node->left != NIL) {
-        return rb_last(node->right);
-    }
-
-    if (PARENT_OF(node) == NIL) {
-        return NULL;
+    if (node->left) {
+        return rb_last(node->left);
     }
 
     struct rb_node *parent = PARENT_OF(node);
-    while (parent != NIL && node == parent->left) {
+    while (parent && node == parent->left) {
         node = parent;
         parent = PARENT_OF(parent);
     }
 
-    return parent == NIL ? NULL : parent;
+    return parent;
 }
 
 struct rb_node *
 rb_first(struct rb_node *tree) {
     struct rb_node *first = tree;
-    while (first->left != NIL) {
+    if (!first) {
+        return NULL;
+    }
+
+    while (first->left) {
         first = first->left;
     }
-    return first == NIL ? NULL : first;
+    return first;
 }
 
 struct rb_node *
 rb_last(struct rb_node *tree) {
     struct rb_node *last = tree;
-    while (last->right != NIL) {
+    if (!last) {
+        return NULL;
+    }
+
+    while (last->right) {
         last = last->right;
     }
-    return last == NIL ? NULL : last;
+    return last;
 }
 
 bool
 rb_is_empty(struct rb_tree *tree) {
-    return tree->root == NIL;
+    return !tree->root;
 }
 
 /*
@@ -436,13 +1659,13 @@ rb_is_empty(struct rb_tree *tree) {
  * Return the black height of a node.
  *
  * The black height of a node is defined as the number of black nodes on the
- * path from the node to any NIL leaf.
+ * path from the node to any NULL leaf.
  */
 static unsigned
 rb_black_height(struct rb_node *node) {
     unsigned black_height = 0;
     struct rb_node *curr = node;
-    while (curr != NIL) {
+    while (curr) {
         if (IS_BLACK(curr)) {
             black_height += 1;
         }
@@ -450,7 +1673,7 @@ rb_black_height(struct rb_node *node) {
         curr = curr->left;
     }
 
-    // The current node is now NIL, meaning it is black, therefore we add one
+    // The current node is now NULL, meaning it is black, therefore we add one
     // to the height.
     return black_height + 1;
 }
@@ -465,7 +1688,13 @@ rb_is_valid(struct rb_tree *tree) {
         return false;
     }
 
-    if (PARENT_OF(tree->root) != NIL) {
+    if (tree->root && PARENT_OF(tree->root)) {
+        return false;
+    }
+
+    // The cached left-most and right-most nodes must be up to date.
+    if (tree->first != rb_first(tree->root) || tree->last != rb_last(tree->root)) {
+        fprintf(stderr, "Cached first or last node is stale\n");
         return false;
     }
 
@@ -489,13 +1718,13 @@ rb_is_valid(struct rb_tree *tree) {
 
 static bool
 rb_is_valid_helper(struct rb_node *node, unsigned expected_black_height, unsigned current_black_height) {
-    if (node == NIL) {
-        // Property 2: All NIL leaves are black.
+    if (!node) {
+        // Property 2: All NULL leaves are black.
         if (!IS_BLACK(node)) {
             return false;
         }
 
-        // Property 4: Every path from a given node to any of its descendant NIL
+        // Property 4: Every path from a given node to any of its descendant NULL
         //             leaves goes through the same number of black nodes.
         if (expected_black_height != current_black_height + 1) {
             fprintf(stderr, "Expected black height %u is not equal to actual black height %u\n", expected_black_height,
@@ -526,11 +1755,11 @@ rb_is_valid_helper(struct rb_node *node, unsigned expected_black_height, unsigne
     }
 
     // Verify various structural properties true of any binary tree.
-    if (PARENT_OF(node) != NIL && PARENT_OF(node)->left != node && PARENT_OF(node)->right != node) {
+    if (PARENT_OF(node) && PARENT_OF(node)->left != node && PARENT_OF(node)->right != node) {
         return false;
     }
 
-    if (node->left != NIL && node->right != NIL && (PARENT_OF(node->left) != node || PARENT_OF(node->right) != node)) {
+    if ((node->left && PARENT_OF(node->left) != node) || (node->right && PARENT_OF(node->right) != node)) {
         return false;
     }
 
@@ -2,6 +2,7 @@
 #define RB_H
 
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 
 #define rb_entry(ptr, type, member)                                                                                    \
@@ -10,8 +11,38 @@
         (type *) ((char *) __mptr - offsetof(type, member));                                                           \
     })
 
-#define rb_for_each(TREE, NODE) for ((NODE) = rb_first((TREE).root); (NODE) != NULL; (NODE) = rb_next(NODE))
+#define rb_for_each(TREE, NODE) for ((NODE) = (TREE).first; (NODE) != NULL; (NODE) = rb_next(NODE))
 
+/*
+ * Iterate over a tree with a cursor, forwards or backwards. Unlike
+ * rb_for_each(), this never follows parent links.
+ */
+#define rb_cursor_for_each(CURSOR, TREE, NODE)                                                                         \
+    for ((NODE) = rb_cursor_first((CURSOR), (TREE)); (NODE) != NULL; (NODE) = rb_cursor_next(CURSOR))
+#define rb_cursor_for_each_reverse(CURSOR, TREE, NODE)                                                                 \
+    for ((NODE) = rb_cursor_last((CURSOR), (TREE)); (NODE) != NULL; (NODE) = rb_cursor_prev(CURSOR))
+
+/*
+ * Iterate over the nodes that are greater than or equal to LOW and less than
+ * HIGH, in order. Neither bound needs to be in the tree.
+ */
+#define rb_for_each_range(TREE, NODE, LOW, HIGH)                                                                       \
+    for ((NODE) = rb_lower_bound(&(TREE), (LOW)); (NODE) != NULL && (TREE).cmp((NODE), (HIGH)) < 0;                    \
+         (NODE) = rb_next(NODE))
+
+/*
+ * The number of descents rb_search_batch() keeps in flight at once.
+ */
+#define RB_BATCH 16
+
+#define RB_UNLINKED ((uintptr_t) 2)
+
+/*
+ * A node, embedded in the element it links into a tree. The lowest bit of
+ * `parent` holds the node's color. Leaves, and the parent of the root, are
+ * NULL, so trees share no state and independent trees never write to the same
+ * memory.
+ */
 struct rb_node {
     uintptr_t parent;
     struct rb_node *left;
@@ -28,9 +59,74 @@ struct rb_node {
  */
 typedef int (*rb_cmp)(struct rb_node *left, struct rb_node *right);
 
+/*
+ * Callbacks that keep a per-node value, computed from a node and its children,
+ * up to date as the shape of an augmented tree changes. They are called by
+ * insertion, removal, and rotation, so per-subtree aggregates such as sizes,
+ * sums, or maximums never need to be recomputed with a walk of the tree.
+ *
+ * - propagate() recomputes `node` and then its ancestors, up to but not
+ *   including `stop`, which may be NULL. It may stop early at an ancestor whose
+ *   value did not change, but must always recompute `node` itself.
+ * - copy() gives `new` the value of `old`, when `new` takes the place of `old`.
+ * - rotate() is called after `new` is rotated into the place of its parent
+ *   `old`. It gives `new` the value of `old` and recomputes `old`.
+ *
+ * RB_DECLARE_AUGMENT() generates all three from a single compute function.
+ */
+struct rb_augment {
+    void (*propagate)(struct rb_node *node, struct rb_node *stop);
+    void (*copy)(struct rb_node *old, struct rb_node *new);
+    void (*rotate)(struct rb_node *old, struct rb_node *new);
+};
+
+/*
+ * A tree. The left-most and right-most nodes are cached in `first` and `last`,
+ * which are kept up to date by every operation that links or unlinks a node.
+ */
+#ifdef RB_STATS
+/*
+ * Counts of the work done on a tree, kept when the library is built with
+ * RB_STATS defined, for finding slow comparators and adversarial key patterns.
+ * Without RB_STATS, neither this nor the counting exists.
+ *
+ * Comparisons count every call of the comparison function made by rb_*
+ * functions, but not by those generated by RB_GENERATE(). The rebalancing
+ * cases are numbered as in CLRS: for insertion, 1 is a red uncle, 2 is a node
+ * on the inside, and 3 is a node on the outside; for removal, 1 is a red
+ * sibling, 2 is a black sibling with black children, 3 is a black sibling with
+ * a red inner child only, and 4 is a black sibling with a red outer child.
+ * The depth is the greatest number of nodes compared in a single lookup or
+ * insertion.
+ */
+struct rb_stats {
+    uint64_t comparisons;
+    uint64_t rotations[2]; // Left, then right.
+    uint64_t insert_cases[3];
+    uint64_t remove_cases[4];
+    uint64_t max_depth;
+};
+#endif
+
 struct rb_tree {
     struct rb_node *root;
+    struct rb_node *first;
+    struct rb_node *last;
     rb_cmp cmp;
+    const struct rb_augment *augment;
+#ifdef RB_STATS
+    struct rb_stats stats;
+#endif
+};
+
+/*
+ * A node in an order-statistic tree, which keeps the number of nodes in the
+ * subtree rooted at each node. Every node inserted into a tree created with
+ * rb_tree_init_sized() must be embedded in one of these.
+ */
+struct rb_sized_node {
+    struct rb_node rb_node;
+    size_t size;
 };
 
 /*
@@ -39,27 +135,141 @@ struct rb_tree {
 struct rb_tree rb_tree_init(rb_cmp cmp);
 
 /*
- * Return a new red-black tree node.
+ * Return a new augmented red-black tree, whose per-node values are kept up to
+ * date through the given callbacks. The callbacks must outlive the tree.
+ *
+ * Trees created with rb_tree_init() pay nothing for augmentation.
+ */
+struct rb_tree rb_tree_init_augmented(rb_cmp cmp, const struct rb_augment *augment);
+
+/*
+ * Return a new order-statistic red-black tree, which supports rb_select(),
+ * rb_rank(), and rb_count_range() in O(log n).
+ */
+struct rb_tree rb_tree_init_sized(rb_cmp cmp);
+
+/*
+ * Return a new red-black tree node. The node is not linked into any tree.
  */
 struct rb_node rb_node_init(void);
 
+/*
+ * Return true if a node is linked into a tree, else false.
+ *
+ * Unlinked nodes have the second-lowest bit of their parent set, which is
+ * never the case for a linked node since parent pointers are aligned. This is
+ * the state left by rb_node_init(), rb_remove(), and rb_erase().
+ */
+static inline bool
+rb_is_linked(const struct rb_node *node) {
+    return !(node->parent & RB_UNLINKED);
+}
+
+/*
+ * Return the parent of a node, or NULL if the node is the root or unlinked.
+ */
+static inline struct rb_node *
+rb_parent(const struct rb_node *node) {
+    return (struct rb_node *) (node->parent & ~(uintptr_t) 3);
+}
+
 /*
  * Insert a node into a red-black tree. If insertion is successful, return the
  * node, else return NULL since an equal node is already in the tree.
  */
 struct rb_node *rb_insert(struct rb_tree *tree, struct rb_node *node);
 
+/*
+ * Find where a node belongs in the tree without linking it. If an equal node
+ * is already in the tree, then return it. Otherwise, return NULL and store the
+ * node's would-be parent and the link that should point to it in `parent` and
+ * `link`, ready to be passed to rb_link_node().
+ *
+ * This allows lookup-or-insert to be done with a single descent:
+ *
+ *     struct rb_node *parent, **link;
+ *     struct rb_node *found = rb_find_slot(tree, node, &parent, &link);
+ *     if (!found) {
+ *         rb_link_node(node, parent, link);
+ *         rb_insert_color(tree, node);
+ *     }
+ */
+struct rb_node *rb_find_slot(struct rb_tree *tree, struct rb_node *node, struct rb_node **parent,
+                             struct rb_node ***link);
+
+/*
+ * Link a node into the tree at the slot found by rb_find_slot(). The tree is
+ * not rebalanced until rb_insert_color() is called. No other operation may be
+ * done on the tree in between.
+ */
+void rb_link_node(struct rb_node *node, struct rb_node *parent, struct rb_node **link);
+
+/*
+ * Rebalance the tree after a node has been linked with rb_link_node().
+ */
+void rb_insert_color(struct rb_tree *tree, struct rb_node *node);
+
+/*
+ * Build a balanced tree out of n nodes, which must be sorted in strictly
+ * increasing order, in O(n). The tree must be empty beforehand. The comparison
+ * function is never called.
+ */
+void rb_build_sorted(struct rb_tree *tree, struct rb_node **nodes, size_t n);
+
 /*
  * If an equal node is in the tree, then return it, else return NULL.
  */
 struct rb_node *rb_search(struct rb_tree *tree, struct rb_node *node);
 
+/*
+ * Search for n keys at once, storing in out[i] the node equal to keys[i], or
+ * NULL if there is none.
+ *
+ * Up to RB_BATCH descents are interleaved, one level at a time, and the next
+ * node of each is prefetched while the others advance. This overlaps their
+ * cache misses, so for large trees it has much higher throughput than calling
+ * rb_search() in a loop.
+ */
+void rb_search_batch(struct rb_tree *tree, struct rb_node **keys, size_t n, struct rb_node **out);
+
+/*
+ * Return the left-most node that is greater than or equal to the given node,
+ * or NULL if there is none.
+ */
+struct rb_node *rb_lower_bound(struct rb_tree *tree, struct rb_node *node);
+
+/*
+ * Return the left-most node that is strictly greater than the given node, or
+ * NULL if there is none.
+ */
+struct rb_node *rb_upper_bound(struct rb_tree *tree, struct rb_node *node);
+
+/*
+ * Return the right-most node that is less than or equal to the given node, or
+ * NULL if there is none.
+ */
+struct rb_node *rb_floor(struct rb_tree *tree, struct rb_node *node);
+
+/*
+ * Return the left-most node that is greater than or equal to the given node,
+ * or NULL if there is none. This is the same as rb_lower_bound().
+ */
+struct rb_node *rb_ceil(struct rb_tree *tree, struct rb_node *node);
+
 /*
  * Remove a node from a red-black tree. Return the removed node if successful,
  * else return NULL since the node was not in the tree.
  */
 struct rb_node *rb_remove(struct rb_tree *tree, struct rb_node *node);
 
+/*
+ * Remove a node that is known to be linked into the tree. Unlike rb_remove(),
+ * no search is done beforehand, so the comparison function is never called.
+ *
+ * Passing a node that is not in the tree corrupts the tree.
+ */
+void rb_erase(struct rb_tree *tree, struct rb_node *node);
+
 /*
  * Return the in-order successor of the given node.
  */
@@ -80,11 +290,359 @@ struct rb_node *rb_first(struct rb_node *tree);
  */
 struct rb_node *rb_last(struct rb_node *tree);
 
+/*
+ * The greatest height of a red-black tree that fits in memory.
+ */
+#define RB_MAX_HEIGHT (2 * 8 * sizeof(void *))
+
+/*
+ * A position in a tree, kept as the path from the root down to the current
+ * node. Stepping with a cursor only reads nodes that are on or next to that
+ * path, rather than climbing parent links as rb_next() and rb_prev() do, and
+ * prefetches the subtree that the following step will descend into.
+ *
+ * A cursor is invalidated by any change to its tree. Once it steps past either
+ * end, it must be repositioned before stepping again.
+ */
+struct rb_cursor {
+    size_t depth;
+    struct rb_node *path[RB_MAX_HEIGHT];
+};
+
+/*
+ * Move a cursor to the left-most node in a tree, and return it, or return NULL
+ * if the tree is empty.
+ */
+struct rb_node *rb_cursor_first(struct rb_cursor *cursor, struct rb_tree *tree);
+
+/*
+ * Move a cursor to the right-most node in a tree, and return it, or return
+ * NULL if the tree is empty.
+ */
+struct rb_node *rb_cursor_last(struct rb_cursor *cursor, struct rb_tree *tree);
+
+/*
+ * Move a cursor to the left-most node that is greater than or equal to the
+ * given node, and return it, or return NULL if there is none.
+ */
+struct rb_node *rb_cursor_seek(struct rb_cursor *cursor, struct rb_tree *tree, struct rb_node *node);
+
+/*
+ * Move a cursor to the next node, and return it, or return NULL if there is
+ * none.
+ */
+struct rb_node *rb_cursor_next(struct rb_cursor *cursor);
+
+/*
+ * Move a cursor to the previous node, and return it, or return NULL if there
+ * is none.
+ */
+struct rb_node *rb_cursor_prev(struct rb_cursor *cursor);
+
+/*
+ * Return the node a cursor is at, or NULL if it has stepped past either end.
+ */
+static inline struct rb_node *
+rb_cursor_get(struct rb_cursor *cursor) {
+    return cursor->depth ? cursor->path[cursor->depth - 1] : NULL;
+}
+
+/*
+ * Return the left-most node in the tree, or NULL if the tree is empty, in
+ * constant time.
+ */
+static inline struct rb_node *
+rb_peek_first(struct rb_tree *tree) {
+    return tree->first;
+}
+
+/*
+ * Return the right-most node in the tree, or NULL if the tree is empty, in
+ * constant time.
+ */
+static inline struct rb_node *
+rb_peek_last(struct rb_tree *tree) {
+    return tree->last;
+}
+
+/*
+ * Remove and return the left-most node in the tree, or NULL if the tree is
+ * empty. No search is done, so the comparison function is never called.
+ */
+struct rb_node *rb_pop_first(struct rb_tree *tree);
+
+/*
+ * Remove and return the right-most node in the tree, or NULL if the tree is
+ * empty. No search is done, so the comparison function is never called.
+ */
+struct rb_node *rb_pop_last(struct rb_tree *tree);
+
+/*
+ * Join two trees and an unlinked pivot node into `left`, leaving `right` empty.
+ * Every node in `left` must be less than the pivot, which must be less than
+ * every node in `right`. Both trees must have the same comparison function and
+ * augmentation. This takes O(log n) and never calls the comparison function.
+ */
+void rb_join(struct rb_tree *left, struct rb_node *pivot, struct rb_tree *right);
+
+/*
+ * Split a tree into `low`, holding the nodes less than `key`, and `high`,
+ * holding the rest, in O(log n). The key does not need to be in the tree. Both
+ * halves are initialized with the tree's comparison function and augmentation,
+ * and the tree is left empty. With RB_STATS, `low` takes over the tree's stats,
+ * along with those of the split itself.
+ */
+void rb_split(struct rb_tree *tree, struct rb_node *key, struct rb_tree *low, struct rb_tree *high);
+
+/*
+ * The set operations below combine two trees with the same comparison function
+ * and augmentation. The result is stored in `a` and `b` is left empty. Where
+ * both trees have equal nodes, the node from `a` is kept. Every node that is
+ * left out of the result is unlinked, which callers can check for with
+ * rb_is_linked() in order to free it.
+ *
+ * Each operation takes O(m log(n / m + 1)) work, where m and n are the sizes of
+ * the smaller and larger tree, plus the number of nodes left out. The work is
+ * spread across up to `threads` threads, which may be 1 to use only the
+ * calling thread.
+ */
+
+/*
+ * Store in `a` the nodes that are in either tree.
+ */
+void rb_union(struct rb_tree *a, struct rb_tree *b, unsigned threads);
+
+/*
+ * Store in `a` the nodes of `a` that are also in `b`.
+ */
+void rb_intersect(struct rb_tree *a, struct rb_tree *b, unsigned threads);
+
+/*
+ * Store in `a` the nodes of `a` that are not in `b`.
+ */
+void rb_difference(struct rb_tree *a, struct rb_tree *b, unsigned threads);
+
+/*
+ * The orders rb_compact() can lay nodes out in.
+ *
+ * RB_LAYOUT_BFS puts each level of the tree after the one above it, so the top
+ * levels, which every search visits, share a few cache lines.
+ *
+ * RB_LAYOUT_VEB puts the top half of the levels first and then each subtree
+ * hanging off them, recursively, so every few consecutive steps of a search
+ * stay within a block of adjacent nodes, whatever the cache line or page size.
+ */
+enum rb_layout {
+    RB_LAYOUT_BFS,
+    RB_LAYOUT_VEB,
+};
+
+/*
+ * Move every element of a tree into `buffer`, one after the other in the given
+ * layout, and return how many were moved. The links and colors are fixed up so
+ * that the tree works as before, but with far fewer cache misses per search.
+ *
+ * Elements are `stride` bytes long, with their struct rb_node at `offset`
+ * bytes in, and are moved with memcpy(). The buffer must have room for every
+ * element, and nothing outside the tree may point to them, since the old
+ * copies are left behind and can be freed once this returns.
+ */
+size_t rb_compact(struct rb_tree *tree, void *buffer, size_t stride, size_t offset, enum rb_layout layout);
+
+/*
+ * Return the node with the given zero-based in-order position in an
+ * order-statistic tree, or NULL if the tree has no more than k nodes.
+ */
+struct rb_node *rb_select(struct rb_tree *tree, size_t k);
+
+/*
+ * Return the zero-based in-order position of a node in an order-statistic
+ * tree.
+ */
+size_t rb_rank(struct rb_node *node);
+
+/*
+ * Return the number of nodes in an order-statistic tree that are greater than
+ * or equal to `low` and less than or equal to `high`. Neither needs to be in
+ * the tree.
+ */
+size_t rb_count_range(struct rb_tree *tree, struct rb_node *low, struct rb_node *high);
+
 /*
  * Return true if a tree is empty, else false.
  */
 bool rb_is_empty(struct rb_tree *tree);
 
+/*
+ * The shape of a tree, as measured by rb_profile(), for deciding when a tree
+ * would benefit from being rebuilt or compacted.
+ *
+ * Depths count the nodes on the path from the root, so the root is at depth 1
+ * and the depth of a node is the number of comparisons it takes to find it.
+ * The black height counts the black nodes on every path from the root down to
+ * a leaf. The locality fractions count the parent-child links whose nodes are
+ * less than 64 bytes, about a cache line, and 4096 bytes, about a page, apart.
+ */
+struct rb_report {
+    size_t nodes;
+    size_t red;
+    size_t black_height;
+    size_t max_depth;
+    double average_depth;
+    double line_local;
+    double page_local;
+    size_t depths[RB_MAX_HEIGHT + 1]; // The number of nodes at each depth.
+};
+
+/*
+ * Measure the shape of a tree in one pass over its nodes, using O(1) memory.
+ */
+void rb_profile(struct rb_tree *tree, struct rb_report *report);
+
+#ifdef RB_STATS
+
+/*
+ * Add one set of stats to another, for totals across trees. The depth of the
+ * total is the greatest of the two.
+ */
+void rb_stats_add(struct rb_stats *total, const struct rb_stats *stats);
+
+#endif
+
+/*
+ * Generate type-specific functions for a tree of `type` elements, linked
+ * through their `field` member and ordered by `cmpfn`, which is called as
+ * `cmpfn(type *left, type *right)` and must return the same values as an
+ * rb_cmp. Comparisons are made directly on the containing type, so the
+ * compiler can inline them instead of calling through the tree's rb_cmp.
+ *
+ * The generated functions are prefixed with `name`:
+ *
+ *     int name_cmp(struct rb_node *, struct rb_node *);
+ *     type *name_insert(struct rb_tree *, type *);
+ *     type *name_search(struct rb_tree *, type *);
+ *     type *name_remove(struct rb_tree *, type *);
+ *     type *name_first(struct rb_tree *);
+ *     type *name_last(struct rb_tree *);
+ *     type *name_next(type *);
+ *     type *name_prev(type *);
+ *
+ * They behave like their rb_* counterparts, and can be mixed freely with them
+ * on the same tree. `name_cmp` wraps `cmpfn` as an rb_cmp, so the tree should
+ * be created with rb_tree_init(name_cmp).
+ */
+#define RB_GENERATE(name, type, field, cmpfn)                                                                          \
+    static inline __attribute__((unused)) int name##_cmp(struct rb_node *left, struct rb_node *right) {                \
+        return cmpfn(rb_entry(left, type, field), rb_entry(right, type, field));                                       \
+    }                                                                                                                  \
+                                                                                                                       \
+    static inline __attribute__((unused)) type *name##_insert(struct rb_tree *tree, type *elm) {                       \
+        struct rb_node *parent = NULL;                                                                                 \
+        struct rb_node **link = &tree->root;                                                                           \
+        while (*link) {                                                                                                \
+            int result = cmpfn(elm, rb_entry(*link, type, field));                                                     \
+            if (__builtin_expect(result == 0, 0)) {                                                                    \
+                return NULL;                                                                                           \
+            }                                                                                                          \
+                                                                                                                       \
+            parent = *link;                                                                                            \
+            link = result < 0 ? &parent->left : &parent->right;                                                        \
+        }                                                                                                              \
+                                                                                                                       \
+        rb_link_node(&elm->field, parent, link);                                                                       \
+        rb_insert_color(tree, &elm->field);                                                                            \
+        return elm;                                                                                                    \
+    }                                                                                                                  \
+                                                                                                                       \
+    static inline __attribute__((unused)) type *name##_search(struct rb_tree *tree, type *elm) {                       \
+        struct rb_node *curr = tree->root;                                                                             \
+        while (curr) {                                                                                                 \
+            int result = cmpfn(elm, rb_entry(curr, type, field));                                                      \
+            if (__builtin_expect(result == 0, 0)) {                                                                    \
+                return rb_entry(curr, type, field);                                                                    \
+            }                                                                                                          \
+                                                                                                                       \
+            curr = result < 0 ? curr->left : curr->right;                                                              \
+        }                                                                                                              \
+                                                                                                                       \
+        return NULL;                                                                                                   \
+    }                                                                                                                  \
+                                                                                                                       \
+    static inline __attribute__((unused)) type *name##_remove(struct rb_tree *tree, type *elm) {                       \
+        if (name##_search(tree, elm) != elm) {                                                                         \
+            return NULL;                                                                                               \
+        }                                                                                                              \
+                                                                                                                       \
+        rb_erase(tree, &elm->field);                                                                                   \
+        return elm;                                                                                                    \
+    }                                                                                                                  \
+                                                                                                                       \
+    static inline __attribute__((unused)) type *name##_first(struct rb_tree *tree) {                                   \
+        struct rb_node *node = tree->first;                                                                            \
+        return node ? rb_entry(node, type, field) : NULL;                                                              \
+    }                                                                                                                  \
+                                                                                                                       \
+    static inline __attribute__((unused)) type *name##_last(struct rb_tree *tree) {                                    \
+        struct rb_node *node = tree->last;                                                                             \
+        return node ? rb_entry(node, type, field) : NULL;                                                              \
+    }                                                                                                                  \
+                                                                                                                       \
+    static inline __attribute__((unused)) type *name##_next(type *elm) {                                               \
+        struct rb_node *node = rb_next(&elm->field);                                                                   \
+        return node ? rb_entry(node, type, field) : NULL;                                                              \
+    }                                                                                                                  \
+                                                                                                                       \
+    static inline __attribute__((unused)) type *name##_prev(type *elm) {                                               \
+        struct rb_node *node = rb_prev(&elm->field);                                                                   \
+        return node ? rb_entry(node, type, field) : NULL;                                                              \
+    }
+
+/*
+ * Declare a `static const struct rb_augment name` for elements of `type`,
+ * linked through their `field` member, whose `augfield` member is computed by
+ * `compute(type *node)` from the node and its children. `augfield` must be a
+ * scalar, since propagation stops as soon as a recomputed value is unchanged.
+ *
+ * For example, to keep the maximum end of every subtree of intervals:
+ *
+ *     static inline uint64_t
+ *     interval_max(struct interval *node) { ... }
+ *
+ *     RB_DECLARE_AUGMENT(interval_augment, struct interval, rb_node, max, interval_max);
+ *
+ *     struct rb_tree tree = rb_tree_init_augmented(cmp, &interval_augment);
+ */
+#define RB_DECLARE_AUGMENT(name, type, field, augfield, compute)                                                       \
+    static void name##_propagate(struct rb_node *node, struct rb_node *stop) {                                         \
+        bool first = true;                                                                                             \
+        while (node != stop) {                                                                                         \
+            type *elm = rb_entry(node, type, field);                                                                   \
+            typeof(elm->augfield) value = compute(elm);                                                                \
+            if (!first && elm->augfield == value) {                                                                    \
+                break;                                                                                                 \
+            }                                                                                                          \
+                                                                                                                       \
+            elm->augfield = value;                                                                                     \
+            first = false;                                                                                             \
+            node = rb_parent(node);                                                                                    \
+        }                                                                                                              \
+    }                                                                                                                  \
+                                                                                                                       \
+    static void name##_copy(struct rb_node *old, struct rb_node *new) {                                                \
+        rb_entry(new, type, field)->augfield = rb_entry(old, type, field)->augfield;                                   \
+    }                                                                                                                  \
+                                                                                                                       \
+    static void name##_rotate(struct rb_node *old, struct rb_node *new) {                                              \
+        name##_copy(old, new);                                                                                         \
+        rb_entry(old, type, field)->augfield = compute(rb_entry(old, type, field));                                    \
+    }                                                                                                                  \
+                                                                                                                       \
+    static const struct rb_augment name = {                                                                            \
+        .propagate = name##_propagate,                                                                                 \
+        .copy = name##_copy,                                                                                           \
+        .rotate = name##_rotate,                                                                                       \
+    }
+
 /*
  * The functions below are only needed for testing.
  */
@@ -94,7 +652,7 @@ bool rb_is_empty(struct rb_tree *tree);
  * Return true if the red-black tree obeys the five necessary properties.
  *
  * 1. Each node is either red or black.
- * 2. All NIL leaves are black.
+ * 2. All NULL leaves are black.
  * 3. If a node is red, then both its children are black.
  * 4. Every path from a given node to any of its descendant NULL leaves goes
  *    through the same number of black nodes.
@@ -0,0 +1,502 @@
+#include "rb32.h"
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define RB32_RED 0
+#define RB32_BLACK UINT32_C(0x80000000)
+
+/*
+ * These take the tree from the enclosing function, so that the code below
+ * reads like its pointer-based counterpart in rb.c.
+ */
+#define NODE(INDEX) ((struct rb32_node *) (tree->base + (size_t) (INDEX) * tree->stride + tree->offset))
+#define ELEM(INDEX) rb32_elem(tree, (INDEX))
+
+#define COLOR_OF(INDEX) (NODE(INDEX)->parent & RB32_BLACK)
+#define IS_RED(INDEX) ((INDEX) != RB32_NIL && COLOR_OF(INDEX) == RB32_RED)
+#define IS_BLACK(INDEX) ((INDEX) == RB32_NIL || COLOR_OF(INDEX) == RB32_BLACK)
+#define PARENT_OF(INDEX) (NODE(INDEX)->parent & ~RB32_BLACK)
+#define SET_PARENT(INDEX, PARENT)                                                                                      \
+    do {                                                                                                               \
+        NODE(INDEX)->parent = (NODE(INDEX)->parent & RB32_BLACK) | (PARENT);                                           \
+    } while (0)
+#define SET_COLOR(INDEX, COLOR)                                                                                        \
+    do {                                                                                                               \
+        NODE(INDEX)->parent = (NODE(INDEX)->parent & ~RB32_BLACK) | (COLOR);                                           \
+    } while (0)
+
+struct rb32_tree
+rb32_tree_init(void *base, size_t stride, size_t offset, rb32_cmp cmp) {
+    struct rb32_tree tree;
+    tree.root = RB32_NIL;
+    tree.first = RB32_NIL;
+    tree.last = RB32_NIL;
+    tree.base = base;
+    tree.stride = stride;
+    tree.offset = offset;
+    tree.cmp = cmp;
+    return tree;
+}
+
+struct rb32_node
+rb32_node_init(void) {
+    // A red node without a parent is never linked, since the root is black.
+    struct rb32_node node;
+    node.parent = RB32_NIL;
+    node.left = RB32_NIL;
+    node.right = RB32_NIL;
+    return node;
+}
+
+// -----------------------------------------------------------------------------
+// Helpers
+// -----------------------------------------------------------------------------
+
+static uint32_t
+rb32_first(struct rb32_tree *tree, uint32_t index) {
+    if (index == RB32_NIL) {
+        return RB32_NIL;
+    }
+
+    while (NODE(index)->left != RB32_NIL) {
+        index = NODE(index)->left;
+    }
+    return index;
+}
+
+static uint32_t
+rb32_last(struct rb32_tree *tree, uint32_t index) {
+    if (index == RB32_NIL) {
+        return RB32_NIL;
+    }
+
+    while (NODE(index)->right != RB32_NIL) {
+        index = NODE(index)->right;
+    }
+    return index;
+}
+
+uint32_t
+rb32_next(struct rb32_tree *tree, uint32_t index) {
+    if (NODE(index)->right != RB32_NIL) {
+        return rb32_first(tree, NODE(index)->right);
+    }
+
+    uint32_t parent = PARENT_OF(index);
+    while (parent != RB32_NIL && index == NODE(parent)->right) {
+        index = parent;
+        parent = PARENT_OF(parent);
+    }
+
+    return parent;
+}
+
+uint32_t
+rb32_prev(struct rb32_tree *tree, uint32_t index) {
+    if (NODE(index)->left != RB32_NIL) {
+        return rb32_last(tree, NODE(index)->left);
+    }
+
+    uint32_t parent = PARENT_OF(index);
+    while (parent != RB32_NIL && index == NODE(parent)->left) {
+        index = parent;
+        parent = PARENT_OF(parent);
+    }
+
+    return parent;
+}
+
+/*
+ * Rotate the node to the left.
+ */
+static void
+rb32_rotate_left(struct rb32_tree *tree, uint32_t node) {
+    uint32_t child = NODE(node)->right;
+    uint32_t parent = PARENT_OF(node);
+    NODE(node)->right = NODE(child)->left;
+
+    if (NODE(child)->left != RB32_NIL) {
+        SET_PARENT(NODE(child)->left, node);
+    }
+
+    SET_PARENT(child, parent);
+
+    if (parent == RB32_NIL) {
+        tree->root = child;
+    } else if (node == NODE(parent)->left) {
+        NODE(parent)->left = child;
+    } else {
+        NODE(parent)->right = child;
+    }
+
+    NODE(child)->left = node;
+    SET_PARENT(node, child);
+}
+
+/*
+ * Rotate the node to the right.
+ */
+static void
+rb32_rotate_right(struct rb32_tree *tree, uint32_t node) {
+    uint32_t child = NODE(node)->left;
+    uint32_t parent = PARENT_OF(node);
+    NODE(node)->left = NODE(child)->right;
+
+    if (NODE(child)->right != RB32_NIL) {
+        SET_PARENT(NODE(child)->right, node);
+    }
+
+    SET_PARENT(child, parent);
+
+    if (parent == RB32_NIL) {
+        tree->root = child;
+    } else if (node == NODE(parent)->right) {
+        NODE(parent)->right = child;
+    } else {
+        NODE(parent)->left = child;
+    }
+
+    NODE(child)->right = node;
+    SET_PARENT(node, child);
+}
+
+/*
+ * Replace the subtree rooted at node u with the subtree rooted at node v.
+ */
+static void
+rb32_transplant(struct rb32_tree *tree, uint32_t u, uint32_t v) {
+    uint32_t parent = PARENT_OF(u);
+    if (parent == RB32_NIL) {
+        tree->root = v;
+    } else if (u == NODE(parent)->left) {
+        NODE(parent)->left = v;
+    } else {
+        NODE(parent)->right = v;
+    }
+
+    if (v != RB32_NIL) {
+        SET_PARENT(v, parent);
+    }
+}
+
+// -----------------------------------------------------------------------------
+// Insertion
+// -----------------------------------------------------------------------------
+
+static void
+rb32_insert_fixup(struct rb32_tree *tree, uint32_t node) {
+    while (node != tree->root && IS_RED(PARENT_OF(node))) {
+        uint32_t parent = PARENT_OF(node);
+        uint32_t grandparent = PARENT_OF(parent);
+
+        if (parent == NODE(grandparent)->left) {
+            uint32_t uncle = NODE(grandparent)->right;
+
+            if (IS_RED(uncle)) {
+                // Case 1
+                SET_COLOR(parent, RB32_BLACK);
+                SET_COLOR(uncle, RB32_BLACK);
+                SET_COLOR(grandparent, RB32_RED);
+                node = grandparent;
+            } else {
+                if (node == NODE(parent)->right) {
+                    // Case 2
+                    node = parent;
+                    rb32_rotate_left(tree, node);
+                    parent = PARENT_OF(node);
+                }
+                // Case 3
+                SET_COLOR(parent, RB32_BLACK);
+                SET_COLOR(grandparent, RB32_RED);
+                rb32_rotate_right(tree, grandparent);
+            }
+        } else {
+            uint32_t uncle = NODE(grandparent)->left;
+
+            if (IS_RED(uncle)) {
+                // Case 1
+                SET_COLOR(parent, RB32_BLACK);
+                SET_COLOR(uncle, RB32_BLACK);
+                SET_COLOR(grandparent, RB32_RED);
+                node = grandparent;
+            } else {
+                if (node == NODE(parent)->left) {
+                    // Case 2
+                    node = parent;
+                    rb32_rotate_right(tree, node);
+                    parent = PARENT_OF(node);
+                }
+                // Case 3
+                SET_COLOR(parent, RB32_BLACK);
+                SET_COLOR(grandparent, RB32_RED);
+                rb32_rotate_left(tree, grandparent);
+            }
+        }
+    }
+
+    SET_COLOR(tree->root, RB32_BLACK);
+}
+
+bool
+rb32_insert(struct rb32_tree *tree, uint32_t index) {
+    // Perform a normal BST descent, remembering the last link followed.
+    uint32_t parent = RB32_NIL;
+    uint32_t *link = &tree->root;
+    while (*link != RB32_NIL) {
+        int result = tree->cmp(ELEM(index), ELEM(*link));
+        if (result == 0) {
+            return false;
+        }
+
+        parent = *link;
+        link = result < 0 ? &NODE(parent)->left : &NODE(parent)->right;
+    }
+
+    NODE(index)->parent = parent | RB32_RED;
+    NODE(index)->left = RB32_NIL;
+    NODE(index)->right = RB32_NIL;
+    *link = index;
+
+    if (parent == RB32_NIL) {
+        tree->first = index;
+        tree->last = index;
+    } else if (parent == tree->first && index == NODE(parent)->left) {
+        tree->first = index;
+    } else if (parent == tree->last && index == NODE(parent)->right) {
+        tree->last = index;
+    }
+
+    rb32_insert_fixup(tree, index);
+    return true;
+}
+
+// -----------------------------------------------------------------------------
+// Search
+// -----------------------------------------------------------------------------
+
+uint32_t
+rb32_search(struct rb32_tree *tree, const void *key) {
+    uint32_t curr = tree->root;
+    while (curr != RB32_NIL) {
+        int result = tree->cmp(key, ELEM(curr));
+
+        if (result == 0) {
+            return curr;
+        }
+
+        curr = result < 0 ? NODE(curr)->left : NODE(curr)->right;
+    }
+
+    return RB32_NIL;
+}
+
+// -----------------------------------------------------------------------------
+// Removal
+// -----------------------------------------------------------------------------
+
+static void
+rb32_remove_fixup(struct rb32_tree *tree, uint32_t node, uint32_t parent) {
+    // The node may be RB32_NIL, so its parent is passed in and kept up to date
+    // rather than read from the node.
+    while (IS_BLACK(node) && node != tree->root) {
+        if (node == NODE(parent)->left) {
+            uint32_t sibling = NODE(parent)->right;
+
+            if (IS_RED(sibling)) {
+                SET_COLOR(sibling, RB32_BLACK);
+                SET_COLOR(parent, RB32_RED);
+                rb32_rotate_left(tree, parent);
+                sibling = NODE(parent)->right;
+            }
+
+            if (IS_BLACK(NODE(sibling)->left) && IS_BLACK(NODE(sibling)->right)) {
+                SET_COLOR(sibling, RB32_RED);
+                node = parent;
+                parent = PARENT_OF(node);
+            } else {
+                if (IS_BLACK(NODE(sibling)->right)) {
+                    SET_COLOR(NODE(sibling)->left, RB32_BLACK);
+                    SET_COLOR(sibling, RB32_RED);
+                    rb32_rotate_right(tree, sibling);
+                    sibling = NODE(parent)->right;
+                }
+
+                SET_COLOR(sibling, COLOR_OF(parent));
+                SET_COLOR(parent, RB32_BLACK);
+                SET_COLOR(NODE(sibling)->right, RB32_BLACK);
+                rb32_rotate_left(tree, parent);
+                node = tree->root;
+            }
+        } else {
+            uint32_t sibling = NODE(parent)->left;
+
+            if (IS_RED(sibling)) {
+                SET_COLOR(sibling, RB32_BLACK);
+                SET_COLOR(parent, RB32_RED);
+                rb32_rotate_right(tree, parent);
+                sibling = NODE(parent)->left;
+            }
+
+            if (IS_BLACK(NODE(sibling)->right) && IS_BLACK(NODE(sibling)->left)) {
+                SET_COLOR(sibling, RB32_RED);
+                node = parent;
+                parent = PARENT_OF(node);
+            } else {
+                if (IS_BLACK(NODE(sibling)->left)) {
+                    SET_COLOR(NODE(sibling)->right, RB32_BLACK);
+                    SET_COLOR(sibling, RB32_RED);
+                    rb32_rotate_left(tree, sibling);
+                    sibling = NODE(parent)->left;
+                }
+
+                SET_COLOR(sibling, COLOR_OF(parent));
+                SET_COLOR(parent, RB32_BLACK);
+                SET_COLOR(NODE(sibling)->left, RB32_BLACK);
+                rb32_rotate_right(tree, parent);
+                node = tree->root;
+            }
+        }
+    }
+
+    if (node != RB32_NIL) {
+        SET_COLOR(node, RB32_BLACK);
+    }
+}
+
+void
+rb32_erase(struct rb32_tree *tree, uint32_t node) {
+    uint32_t child = RB32_NIL;
+    uint32_t parent = RB32_NIL;
+    uint32_t color = COLOR_OF(node);
+
+    if (node == tree->first) {
+        tree->first = rb32_next(tree, node);
+    }
+
+    if (node == tree->last) {
+        tree->last = rb32_prev(tree, node);
+    }
+
+    if (NODE(node)->left == RB32_NIL) {
+        // Only a right child.
+        child = NODE(node)->right;
+        parent = PARENT_OF(node);
+        rb32_transplant(tree, node, child);
+    } else if (NODE(node)->right == RB32_NIL) {
+        // Only a left child.
+        child = NODE(node)->left;
+        parent = PARENT_OF(node);
+        rb32_transplant(tree, node, child);
+    } else {
+        // Two children.
+        uint32_t next = rb32_first(tree, NODE(node)->right);
+        color = COLOR_OF(next);
+        child = NODE(next)->right;
+
+        if (PARENT_OF(next) == node) {
+            parent = next;
+        } else {
+            parent = PARENT_OF(next);
+            rb32_transplant(tree, next, child);
+            NODE(next)->right = NODE(node)->right;
+            SET_PARENT(NODE(next)->right, next);
+        }
+
+        rb32_transplant(tree, node, next);
+        NODE(next)->left = NODE(node)->left;
+        SET_PARENT(NODE(next)->left, next);
+        SET_COLOR(next, COLOR_OF(node));
+    }
+
+    if (color == RB32_BLACK) {
+        rb32_remove_fixup(tree, child, parent);
+    }
+
+    *NODE(node) = rb32_node_init();
+}
+
+uint32_t
+rb32_remove(struct rb32_tree *tree, const void *key) {
+    uint32_t index = rb32_search(tree, key);
+    if (index != RB32_NIL) {
+        rb32_erase(tree, index);
+    }
+
+    return index;
+}
+
+/*
+ * The functions below are only needed for testing.
+ */
+#ifndef NDEBUG
+
+#include <stdio.h>
+
+/*
+ * Return the black height of the subtree rooted at a node, counting the NIL
+ * leaves, or 0 if it breaks any of the red-black or structural properties.
+ */
+static unsigned
+rb32_check(struct rb32_tree *tree, uint32_t node) {
+    if (node == RB32_NIL) {
+        return 1;
+    }
+
+    uint32_t left = NODE(node)->left;
+    uint32_t right = NODE(node)->right;
+
+    if (IS_RED(node) && (IS_RED(left) || IS_RED(right))) {
+        fprintf(stderr, "A red node has non-black children\n");
+        return 0;
+    }
+
+    if ((left != RB32_NIL && PARENT_OF(left) != node) || (right != RB32_NIL && PARENT_OF(right) != node)) {
+        return 0;
+    }
+
+    unsigned left_height = rb32_check(tree, left);
+    unsigned right_height = rb32_check(tree, right);
+    if (left_height == 0 || right_height == 0) {
+        return 0;
+    }
+
+    if (left_height != right_height) {
+        fprintf(stderr, "Black heights %u and %u differ\n", left_height, right_height);
+        return 0;
+    }
+
+    return left_height + IS_BLACK(node);
+}
+
+bool
+rb32_is_valid(struct rb32_tree *tree) {
+    if (!IS_BLACK(tree->root)) {
+        fprintf(stderr, "Tree root is not black\n");
+        return false;
+    }
+
+    if (tree->root != RB32_NIL && PARENT_OF(tree->root) != RB32_NIL) {
+        return false;
+    }
+
+    if (tree->first != rb32_first(tree, tree->root) || tree->last != rb32_last(tree, tree->root)) {
+        fprintf(stderr, "Cached first or last node is stale\n");
+        return false;
+    }
+
+    // Ensure all nodes are strictly increasing.
+    uint32_t prev = RB32_NIL;
+    uint32_t curr = RB32_NIL;
+    rb32_for_each(tree, curr) {
+        if (prev != RB32_NIL && tree->cmp(ELEM(prev), ELEM(curr)) >= 0) {
+            return false;
+        }
+
+        prev = curr;
+    }
+
+    return rb32_check(tree, tree->root) != 0;
+}
+
+#endif
@@ -0,0 +1,129 @@
+#ifndef RB32_H
+#define RB32_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * A red-black tree over the elements of a caller-supplied array, linked by
+ * 32-bit indices into the array rather than pointers. Links take 12 bytes per
+ * element instead of the 24 bytes of struct rb_node, so about twice as many
+ * elements fit in cache.
+ *
+ * Since links are indices, the array may be moved, for example by realloc(),
+ * as long as the tree's `base` is updated to match.
+ */
+
+/*
+ * The index that stands for no element, like NULL does for struct rb_node.
+ * Indices must be less than this, which leaves room for about 2^31 elements.
+ */
+#define RB32_NIL UINT32_C(0x7fffffff)
+
+#define rb32_for_each(TREE, INDEX)                                                                                    \
+    for ((INDEX) = (TREE)->first; (INDEX) != RB32_NIL; (INDEX) = rb32_next((TREE), (INDEX)))
+
+/*
+ * The links of an element. The color is stored in the top bit of `parent`.
+ */
+struct rb32_node {
+    uint32_t parent;
+    uint32_t left;
+    uint32_t right;
+};
+
+/*
+ * Compare two elements, like the comparison function passed to qsort(). The
+ * left one may be a search key that is not in the array.
+ */
+typedef int (*rb32_cmp)(const void *left, const void *right);
+
+struct rb32_tree {
+    uint32_t root;
+    uint32_t first;
+    uint32_t last;
+    unsigned char *base;
+    size_t stride;
+    size_t offset;
+    rb32_cmp cmp;
+};
+
+/*
+ * Return a new tree over an array starting at `base`, whose elements are
+ * `stride` bytes apart and have their struct rb32_node at `offset` bytes in.
+ * For an array of struct elem with a member `node`, that is:
+ *
+ *     rb32_tree_init(array, sizeof(struct elem), offsetof(struct elem, node), cmp)
+ */
+struct rb32_tree rb32_tree_init(void *base, size_t stride, size_t offset, rb32_cmp cmp);
+
+/*
+ * Return a new node. The node is not linked into any tree.
+ */
+struct rb32_node rb32_node_init(void);
+
+/*
+ * Return true if a node is linked into a tree, else false.
+ */
+static inline bool
+rb32_is_linked(struct rb32_node *node) {
+    return node->parent != RB32_NIL;
+}
+
+/*
+ * Return the element at the given index.
+ */
+static inline void *
+rb32_elem(struct rb32_tree *tree, uint32_t index) {
+    return tree->base + (size_t) index * tree->stride;
+}
+
+/*
+ * Insert the element at the given index. If an equal element is already in
+ * the tree, then return false and leave the tree unchanged, else return true.
+ */
+bool rb32_insert(struct rb32_tree *tree, uint32_t index);
+
+/*
+ * Return the index of the element equal to the key, or RB32_NIL if there is
+ * none.
+ */
+uint32_t rb32_search(struct rb32_tree *tree, const void *key);
+
+/*
+ * Remove the element equal to the key and return its index, or return RB32_NIL
+ * if there is none.
+ */
+uint32_t rb32_remove(struct rb32_tree *tree, const void *key);
+
+/*
+ * Remove the element at the given index, which must be in the tree.
+ */
+void rb32_erase(struct rb32_tree *tree, uint32_t index);
+
+/*
+ * Return the index of the next element in the tree, or RB32_NIL if it is the
+ * last.
+ */
+uint32_t rb32_next(struct rb32_tree *tree, uint32_t index);
+
+/*
+ * Return the index of the previous element in the tree, or RB32_NIL if it is
+ * the first.
+ */
+uint32_t rb32_prev(struct rb32_tree *tree, uint32_t index);
+
+/*
+ * The functions below are only needed for testing.
+ */
+#ifndef NDEBUG
+
+/*
+ * Return true if the tree obeys the red-black properties, as in rb_is_valid().
+ */
+bool rb32_is_valid(struct rb32_tree *tree);
+
+#endif
+
+#endif